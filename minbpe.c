@@ -1,10 +1,17 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
 
 #define INITIAL_VOCAB_SIZE 256
-#define MAX_TEXT_SIZE 1024
 
 // Define the structures
 typedef struct {
@@ -17,42 +24,565 @@ typedef struct {
     int idx;
 } Merge;
 
+// Memory functions for everything a tokenizer allocates, so that an embedding
+// application can account for the memory, cap it or place it in its own pools.
+// `user` is passed back on every call. Wherever an allocator is taken, NULL
+// means the C library's malloc(), realloc() and free(). As with the C
+// library, realloc() is called with a NULL `data` to allocate afresh, and
+// must then behave like alloc(); free() is never called with NULL.
+typedef struct {
+    void* (*alloc)(void *user, size_t size);
+    void* (*realloc)(void *user, void *data, size_t size);
+    void (*free)(void *user, void *data);
+    void *user;
+} Allocator;
+
+#define PAIR_TABLE_EMPTY UINT64_MAX
+#define ARENA_BLOCK_SIZE 16384
+#define COUNT_TABLE_PAIRS 65536 // pairs a counting table starts with room for; it grows past that
+
+// Bump allocator for the memory a tokenizer owns. Blocks are chained, each at
+// least twice the size of the one before, and are only freed all together.
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+    size_t last;                // offset of the latest allocation, which can still grow in place
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;
+    const Allocator *allocator;
+} Arena;
+
+// Open-addressing hash table keyed by a packed (first, second) pair.
+// Occupied slots are also recorded in insertion order so that iteration
+// and clearing only touch the pairs that are actually present.
+typedef struct {
+    uint64_t *keys;
+    size_t *values;
+    size_t *order;
+    size_t size;
+    size_t capacity;
+    const Allocator *allocator;
+} PairTable;
+
+// Special tokens such as <|endoftext|>: fixed ids whose strings are never
+// split. The trie and per-node arrays form an Aho-Corasick automaton over the
+// strings, with node 0 as the root.
+typedef struct {
+    unsigned char *bytes;       // special i is bytes[offsets[i] .. offsets[i + 1])
+    size_t *offsets;
+    int *ids;
+    size_t size;
+    PairTable by_id;            // (id, 0) -> special index + 1
+    PairTable trie;             // (node, byte) -> child node
+    size_t *fail;               // node of the longest proper suffix that is also in the trie
+    size_t *output;             // special index + 1 whose string ends at the node, or 0
+    size_t *dict;               // nearest node on the fail chain with an output, or 0
+    size_t *depth;
+    size_t num_nodes;
+    const Allocator *allocator;
+} SpecialTokens;
+
+// Which special tokens encode_special() recognises, as minbpe's allowed_special.
+typedef enum {
+    SPECIAL_NONE_RAISE,         // none, and the text must not contain any
+    SPECIAL_NONE,               // none; their strings are encoded as ordinary text
+    SPECIAL_ALL,
+    SPECIAL_CUSTOM              // only those whose ids are listed
+} SpecialPolicy;
+
+// Built-in pre-tokenization patterns. Text is split into chunks before BPE and
+// merges never cross a chunk boundary, as in minbpe's RegexTokenizer.
+typedef enum {
+    SPLIT_NONE,
+    SPLIT_GPT2,
+    SPLIT_GPT4
+} SplitPattern;
+
+#define GPT2_SPLIT_PATTERN "'(?:[sdmt]|ll|ve|re)| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)|\\s+"
+#define GPT4_SPLIT_PATTERN "'(?i:[sdmt]|ll|ve|re)|[^\\r\\n\\p{L}\\p{N}]?+\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]++[\\r\\n]*|\\s*[\\r\\n]|\\s+(?!\\S)|\\s+"
+
 typedef struct {
     Merge *merges;
     size_t num_merges;
-    unsigned char **vocab;
+    size_t merges_capacity;     // also sizes vocab_offsets, which has room for 256 + merges_capacity + 1 entries
+    unsigned char *vocab;       // expanded bytes of every token, back to back
+    size_t vocab_capacity;      // bytes allocated for vocab
+    size_t *vocab_offsets;      // token i is vocab[vocab_offsets[i] .. vocab_offsets[i + 1])
     size_t vocab_size;
+    PairTable merge_ranks;
+    SplitPattern split_pattern;
+    SpecialTokens specials;     // always heap-owned, also for a mapped tokenizer
+    void *mapping;              // non-NULL when the arrays above point into a file loaded by load_tokenizer()
+    size_t mapping_size;
+    Arena arena;                // holds this struct, and the arrays above unless they are mapped
+    const Allocator *allocator; // used for the arena and all scratch memory; NULL for the C library
+    uint64_t generation;        // changes whenever the merges change; never reused
 } BasicTokenizer;
 
+#define MODEL_MAGIC "BPEC\0\0\0\0"
+#define MODEL_VERSION 3
+#define MODEL_BYTE_ORDER 0x01020304u
+
+// Header of the binary model format. It is followed by these sections, each
+// starting on an 8-byte boundary: merges, vocab offsets, merge-rank table
+// keys, merge-rank table values, the vocab bytes, special token ids (int32),
+// special token offsets and the special token bytes.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t num_merges;
+    uint64_t vocab_size;
+    uint64_t vocab_bytes;
+    uint64_t rank_capacity;
+    uint64_t rank_size;
+    uint64_t split_pattern;
+    uint64_t num_specials;
+    uint64_t special_bytes;
+} ModelHeader;
+
+
+// Binary min-heap ordered by (key, value); `tag` is carried along for the
+// caller. Entries are never updated in place; callers push a fresh entry and
+// skip stale ones when popping.
+typedef struct {
+    size_t key;
+    size_t value;
+    size_t tag;
+} HeapItem;
+
+typedef struct {
+    HeapItem *items;
+    size_t size;
+    size_t capacity;
+    const Allocator *allocator;
+} Heap;
+
+// Fixed set of worker threads that run a batch of indexed tasks. The thread
+// calling thread_pool_run() works on the batch too, as worker 0.
+typedef void (*ThreadTask)(void *context, size_t task, int worker);
+
+typedef struct ThreadPool ThreadPool;
+
+typedef struct {
+    ThreadPool *pool;
+    int index;
+    pthread_t thread;
+} ThreadWorker;
+
+struct ThreadPool {
+    ThreadWorker *workers;
+    int num_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    ThreadTask task;
+    void *context;
+    size_t num_tasks;
+    size_t next_task;
+    size_t done_tasks;
+    int stopping;
+};
+
+#define NO_NODE SIZE_MAX
+
+// Live count of one pair during incremental training, plus the head of the
+// list of nodes where the pair currently starts. `first` is the leftmost of
+// those nodes, or only a lower bound for it while `first_stale` is set.
+typedef struct {
+    IntPair pair;
+    size_t count;
+    size_t head;
+    size_t first;
+    int first_stale;
+    int touched;                // listed in TrainState.touched
+} PairStats;
+
+// Working state for incremental training. The token sequence is a doubly
+// linked list over nodes, and every node whose pair (token, next token) is
+// live sits in exactly one per-pair occurrence list.
+typedef struct {
+    int *tokens;
+    size_t *prev;
+    size_t *next;
+    size_t *occ_prev;
+    size_t *occ_next;
+    size_t num_nodes;
+    PairTable pair_index;
+    PairStats *stats;
+    size_t num_stats;
+    size_t stats_capacity;
+    size_t *touched;            // pairs linked since the queue was last updated
+    size_t num_touched;
+    Heap queue;
+    size_t *positions;
+    size_t *weights;            // occurrences each node stands for; NULL means 1
+    const Allocator *allocator;
+} TrainState;
+
+// Distinct byte strings with their frequencies, in first-seen order. `slots`
+// is an open-addressing index into the entries, stored off by one so that 0
+// means empty.
+typedef struct {
+    unsigned char *bytes;
+    size_t bytes_size;
+    size_t bytes_capacity;
+    size_t *offsets;            // entry i is bytes[offsets[i] .. offsets[i] + lengths[i])
+    size_t *lengths;
+    size_t *counts;
+    size_t size;
+    size_t entries_capacity;
+    size_t *slots;
+    size_t capacity;
+    const Allocator *allocator;
+} ChunkTable;
+
+#define ENCODE_CACHE_SIZE 8192       // chunks cached per workspace by default
+#define ENCODE_CACHE_INITIAL 64      // entries allocated on first use; doubled as the cache fills
+#define ENCODE_SLICE_SIZE 65536      // input bytes encode_u16() encodes at a time with a split pattern
+#define ENCODE_CACHE_MAX_CHUNK 32    // longer chunks are always merged
+
+// A cached chunk and its ids. A chunk never has more ids than bytes.
+typedef struct {
+    uint64_t hash;
+    unsigned char bytes[ENCODE_CACHE_MAX_CHUNK];
+    int ids[ENCODE_CACHE_MAX_CHUNK];
+    unsigned char length;
+    unsigned char ids_size;
+    unsigned char referenced;   // set on a hit, cleared as the clock hand passes
+} CacheEntry;
+
+// Reusable scratch for encode(): links between the surviving symbols and a
+// queue of candidate merges keyed by (rank, position). With a split pattern it
+// also holds a bounded cache of chunk ids for the tokenizer it was last used
+// with, evicted with the CLOCK policy.
+typedef struct {
+    size_t *prev;
+    size_t *next;
+    size_t capacity;
+    Heap queue;
+    uint64_t cache_generation;  // generation of the tokenizer the cache holds ids for, 0 if none
+    CacheEntry *cache;
+    size_t cache_size;
+    size_t cache_limit;         // maximum number of entries; 0 disables the cache
+    size_t cache_allocated;     // entries allocated so far, at most cache_limit
+    size_t cache_hand;
+    size_t *cache_slots;        // open-addressing index of entry + 1, 0 if empty
+    size_t cache_capacity;
+    size_t cache_hits;
+    size_t cache_misses;
+    const Allocator *allocator;
+} EncodeWorkspace;
+
+typedef void (*TokenSink)(void *user, const int *ids, size_t ids_size);
+typedef size_t (*ByteSource)(void *user, char *buffer, size_t capacity);
+
+// Incremental encoder state. Bytes are held back only until a position is
+// found that no multi-byte token of the vocab can cross; everything before
+// it encodes the same whatever comes next.
+typedef struct {
+    const BasicTokenizer *tokenizer;
+    PairTable trie;             // (node, byte) -> child node over the bytes of every token
+    unsigned char *trie_token;  // whether a trie node ends a token
+    size_t max_token_size;
+    char *buffer;
+    size_t buffer_size;
+    size_t buffer_capacity;
+    size_t spanned;             // splits 1 .. spanned of the buffer are known to be crossed by a token
+    size_t rescan_size;         // with a split pattern, buffer size at which to look for final chunks again
+    int *ids;
+    size_t ids_capacity;
+    EncodeWorkspace workspace;
+    const Allocator *allocator;
+} StreamEncoder;
+
+// Token-by-token decoder that holds back an incomplete UTF-8 sequence until
+// the tokens that complete it arrive.
+typedef struct {
+    const BasicTokenizer *tokenizer;
+    unsigned char pending[3];
+    size_t pending_size;
+} StreamDecoder;
+
 
 BasicTokenizer* create_tokenizer();
+BasicTokenizer* create_tokenizer_with_allocator(const Allocator *allocator);
 void clean_tokenizer(BasicTokenizer *tokenizer);
-void train(BasicTokenizer *tokenizer, const char *text, size_t vocab_size, int verbose);
+void set_split_pattern(BasicTokenizer *tokenizer, SplitPattern pattern);
+int add_special_token(BasicTokenizer *tokenizer, const char *token, int id);
+int reserve_tokenizer(BasicTokenizer *tokenizer, size_t vocab_size);
+int train(BasicTokenizer *tokenizer, const char *text, size_t vocab_size, int verbose);
+int train_bytes(BasicTokenizer *tokenizer, const char *data, size_t size, size_t vocab_size, int verbose);
+int train_parallel(BasicTokenizer *tokenizer, const char *data, size_t size, size_t vocab_size, ThreadPool *pool, int verbose);
+int train_incremental(BasicTokenizer *tokenizer, const char *data, size_t size, size_t vocab_size, int verbose);
+int train_files(BasicTokenizer *tokenizer, const char *const *paths, size_t num_paths, size_t vocab_size, int verbose);
+int train_words(BasicTokenizer *tokenizer, const char *data, size_t size, size_t vocab_size, int verbose);
 void encode(BasicTokenizer *tokenizer, const char *text, int *ids, size_t *ids_size);
-void decode(const BasicTokenizer *tokenizer, const int *ids, size_t ids_size, char *text);
+int encode_bytes(const BasicTokenizer *tokenizer, const char *data, size_t size, int *ids, size_t *ids_size);
+int encode_special(const BasicTokenizer *tokenizer, const char *data, size_t size, SpecialPolicy policy,
+                   const int *allowed_ids, size_t num_allowed, int *ids, size_t *ids_size);
+size_t token_id_width(const BasicTokenizer *tokenizer);
+int encode_u16(const BasicTokenizer *tokenizer, const char *data, size_t size, uint16_t *ids, size_t *ids_size);
+int encode_u32(const BasicTokenizer *tokenizer, const char *data, size_t size, uint32_t *ids, size_t *ids_size);
+EncodeWorkspace* create_encode_workspace();
+EncodeWorkspace* create_encode_workspace_with_allocator(const Allocator *allocator);
+void clean_encode_workspace(EncodeWorkspace *workspace);
+void set_encode_cache_size(EncodeWorkspace *workspace, size_t entries);
+void encode_cache_stats(const EncodeWorkspace *workspace, size_t *hits, size_t *misses);
+int encode_with_workspace(const BasicTokenizer *tokenizer, const char *text, size_t text_size,
+                          int *ids, size_t *ids_size, EncodeWorkspace *workspace);
+int encode_batch(const BasicTokenizer *tokenizer, const char *const *docs, const size_t *doc_sizes, size_t num_docs,
+                 int *ids, size_t *offsets, ThreadPool *pool);
+StreamEncoder* create_stream_encoder(const BasicTokenizer *tokenizer);
+void clean_stream_encoder(StreamEncoder *encoder);
+int stream_encoder_push(StreamEncoder *encoder, const char *data, size_t size, TokenSink sink, void *user);
+int stream_encoder_finish(StreamEncoder *encoder, TokenSink sink, void *user);
+int encode_stream(const BasicTokenizer *tokenizer, ByteSource source, void *source_user, TokenSink sink, void *sink_user);
+void stream_decoder_init(StreamDecoder *decoder, const BasicTokenizer *tokenizer);
+size_t stream_decoder_push(StreamDecoder *decoder, int id, char *text);
+size_t stream_decoder_flush(StreamDecoder *decoder, char *text);
+size_t decode(const BasicTokenizer *tokenizer, const int *ids, size_t ids_size, char *text, size_t text_size);
+size_t decode_bytes(const BasicTokenizer *tokenizer, const int *ids, size_t ids_size, char *data, size_t capacity);
+const unsigned char* token_bytes(const BasicTokenizer *tokenizer, int id, size_t *length);
+int build_merge_index(BasicTokenizer *tokenizer);
+size_t merge_rank(const BasicTokenizer *tokenizer, IntPair pair);
+int save_tokenizer(const BasicTokenizer *tokenizer, const char *path);
+BasicTokenizer* load_tokenizer(const char *path);
+BasicTokenizer* load_tokenizer_with_allocator(const char *path, const Allocator *allocator);
+int save_minbpe_model(const BasicTokenizer *tokenizer, const char *file_prefix);
+BasicTokenizer* load_minbpe_model(const char *model_file);
+BasicTokenizer* load_minbpe_model_with_allocator(const char *model_file, const Allocator *allocator);
 size_t find_pair_index(Merge *merges, size_t merges_size, IntPair pair);
-void token_counts(const int *ids, size_t ids_size, size_t *pair_counts, size_t *pair_counts_size);
+int pair_table_init(PairTable *table, size_t expected_pairs);
+int pair_table_init_with_allocator(PairTable *table, size_t expected_pairs, const Allocator *allocator);
+void pair_table_free(PairTable *table);
+void pair_table_clear(PairTable *table);
+size_t* pair_table_get(PairTable *table, IntPair pair);
+const size_t* pair_table_find(const PairTable *table, IntPair pair);
+IntPair pair_table_key(const PairTable *table, size_t i);
+int token_counts(const int *ids, size_t ids_size, PairTable *pair_counts);
+int token_counts_parallel(const int *ids, size_t ids_size, PairTable *pair_counts, PairTable *chunk_counts, ThreadPool *pool);
+ThreadPool* create_thread_pool(int num_threads);
+void destroy_thread_pool(ThreadPool *pool);
+int thread_pool_size(const ThreadPool *pool);
+void thread_pool_run(ThreadPool *pool, ThreadTask task, void *context, size_t num_tasks);
 void merge(int *ids, size_t *ids_size, IntPair pair, int idx);
+void merge_many(int *ids, size_t *ids_size, const PairTable *merges);
+void merge_parallel(int *ids, size_t *ids_size, IntPair pair, int idx, int *scratch, ThreadPool *pool,
+                    const Allocator *allocator);
+
+
+static void* mem_alloc(const Allocator *allocator, size_t size) {
+    return allocator ? allocator->alloc(allocator->user, size) : malloc(size);
+}
+
+static void* mem_calloc(const Allocator *allocator, size_t count, size_t size) {
+    if (!allocator) {
+        return calloc(count, size);
+    }
+    if (size != 0 && count > SIZE_MAX / size) {
+        return NULL;
+    }
+    void *data = allocator->alloc(allocator->user, count * size);
+    if (data) {
+        memset(data, 0, count * size);
+    }
+    return data;
+}
+
+static void* mem_realloc(const Allocator *allocator, void *data, size_t size) {
+    return allocator ? allocator->realloc(allocator->user, data, size) : realloc(data, size);
+}
+
+static void mem_free(const Allocator *allocator, void *data) {
+    if (!allocator) {
+        free(data);
+    } else if (data) {
+        allocator->free(allocator->user, data);
+    }
+}
+
+static pthread_mutex_t generation_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t last_generation = 0;
+
+/*
+* @brief Returns a tokenizer generation that has never been handed out before.
+*/
+static uint64_t next_generation() {
+    pthread_mutex_lock(&generation_lock);
+    uint64_t generation = ++last_generation;
+    pthread_mutex_unlock(&generation_lock);
+    return generation;
+}
+
+static void special_tokens_free(SpecialTokens *specials) {
+    const Allocator *allocator = specials->allocator;
+    mem_free(allocator, specials->bytes);
+    mem_free(allocator, specials->offsets);
+    mem_free(allocator, specials->ids);
+    pair_table_free(&specials->by_id);
+    pair_table_free(&specials->trie);
+    mem_free(allocator, specials->fail);
+    mem_free(allocator, specials->output);
+    mem_free(allocator, specials->dict);
+    mem_free(allocator, specials->depth);
+    memset(specials, 0, sizeof(SpecialTokens));
+    specials->allocator = allocator;
+}
 
+static size_t align16(size_t size) {
+    return (size + 15) & ~(size_t)15;
+}
+
+/*
+* @brief Carves `size` bytes out of the arena, starting a new block if the current one is full.
+*
+* @return Pointer to the memory, aligned to 16 bytes, or NULL if allocation fails.
+*/
+static void* arena_alloc(Arena *arena, size_t size) {
+    ArenaBlock *block = arena->head;
+    size = align16(size);
+    if (!block || block->size - block->used < size) {
+        size_t block_size = block ? block->size * 2 : ARENA_BLOCK_SIZE;
+        while (block_size < size) {
+            block_size *= 2;
+        }
+        size_t header_size = align16(sizeof(ArenaBlock));
+        block = (ArenaBlock*)mem_alloc(arena->allocator, header_size + block_size);
+        if (!block) {
+            return NULL;
+        }
+        block->next = arena->head;
+        block->size = block_size;
+        block->used = 0;
+        arena->head = block;
+    }
+    block->last = block->used;
+    block->used += size;
+    return (unsigned char*)block + align16(sizeof(ArenaBlock)) + block->last;
+}
+
+/*
+* @brief Resizes an arena allocation of `old_size` bytes to `new_size`.
+*
+* The latest allocation of the current block grows in place while the block
+* has room; anything else is copied to a new allocation and the old space is
+* only reclaimed when the arena is freed.
+*
+* @return Pointer to the resized memory, or NULL if allocation fails.
+*/
+static void* arena_grow(Arena *arena, void *data, size_t old_size, size_t new_size) {
+    ArenaBlock *block = arena->head;
+    if (block && (unsigned char*)data == (unsigned char*)block + align16(sizeof(ArenaBlock)) + block->last &&
+        block->size - block->last >= align16(new_size)) {
+        block->used = block->last + align16(new_size);
+        return data;
+    }
+    void *grown = arena_alloc(arena, new_size);
+    if (grown && old_size > 0) {
+        memcpy(grown, data, old_size);
+    }
+    return grown;
+}
+
+static void arena_free(Arena *arena) {
+    ArenaBlock *block = arena->head;
+    while (block) {
+        ArenaBlock *next = block->next;
+        mem_free(arena->allocator, block);
+        block = next;
+    }
+    arena->head = NULL;
+}
+
+/*
+* @brief Makes room for the tokenizer to hold `vocab_size` tokens without reallocating.
+*
+* Sizes the merge list and the vocab offsets for that many tokens. Training
+* and loading call it with the size they are aiming for; without it,
+* add_merge() grows both geometrically. The bytes of the new tokens are not
+* known in advance and always grow geometrically.
+*
+* @param tokenizer Pointer to the BasicTokenizer.
+* @param vocab_size Number of tokens, special tokens excluded, to make room for.
+* @return 0 on success, -1 if allocation fails.
+*/
+int reserve_tokenizer(BasicTokenizer *tokenizer, size_t vocab_size) {
+    if (vocab_size <= INITIAL_VOCAB_SIZE + tokenizer->merges_capacity) {
+        return 0;
+    }
+    size_t capacity = vocab_size - INITIAL_VOCAB_SIZE;
+    Merge *merges = (Merge*)arena_alloc(&tokenizer->arena, capacity * sizeof(Merge));
+    size_t *offsets = (size_t*)arena_alloc(&tokenizer->arena, (INITIAL_VOCAB_SIZE + capacity + 1) * sizeof(size_t));
+    if (!merges || !offsets) {
+        return -1;
+    }
+    if (tokenizer->num_merges > 0) {
+        memcpy(merges, tokenizer->merges, tokenizer->num_merges * sizeof(Merge));
+    }
+    memcpy(offsets, tokenizer->vocab_offsets, (tokenizer->vocab_size + 1) * sizeof(size_t));
+    tokenizer->merges = merges;
+    tokenizer->vocab_offsets = offsets;
+    tokenizer->merges_capacity = capacity;
+    return 0;
+}
 
 /*
 * @brief creates a new BasicTokenizer.
 *
 * Initializes a new BasicTokenizer with an empty merge list and a vocabulary
-* containing the first 256 ASCII characters.
+* containing the first 256 ASCII characters. The tokenizer and everything it
+* learns live in one arena, so creating one costs a single allocation.
 *
 * @return A pointer to the newly created BasicTokenizer, or NULL if allocation fails.
 */
 BasicTokenizer* create_tokenizer() {
-    BasicTokenizer *tokenizer = (BasicTokenizer*)malloc(sizeof(BasicTokenizer));
+    return create_tokenizer_with_allocator(NULL);
+}
+
+/*
+* @brief Creates a new BasicTokenizer that allocates through `allocator`.
+*
+* Everything the tokenizer owns, and the scratch memory of every function that
+* trains, encodes with or saves it, is allocated through the allocator. It
+* may be called from the thread pool's threads during encode_batch().
+*
+* @param allocator Memory functions to use, or NULL for the C library; must outlive the tokenizer.
+* @return A pointer to the newly created BasicTokenizer, or NULL if allocation fails.
+*/
+BasicTokenizer* create_tokenizer_with_allocator(const Allocator *allocator) {
+    Arena arena = { NULL, allocator };
+    BasicTokenizer *tokenizer = (BasicTokenizer*)arena_alloc(&arena, sizeof(BasicTokenizer));
+    if (!tokenizer) {
+        return NULL;
+    }
+    tokenizer->arena = arena;
+    tokenizer->allocator = allocator;
+    tokenizer->generation = next_generation();
     tokenizer->merges = NULL;
     tokenizer->num_merges = 0;
-    tokenizer->vocab = (unsigned char**)malloc(INITIAL_VOCAB_SIZE * sizeof(unsigned char*));
+    tokenizer->merges_capacity = 0;
+    tokenizer->vocab_offsets = (size_t*)arena_alloc(&tokenizer->arena, (INITIAL_VOCAB_SIZE + 1) * sizeof(size_t));
+    tokenizer->vocab = (unsigned char*)arena_alloc(&tokenizer->arena, INITIAL_VOCAB_SIZE * sizeof(unsigned char));
+    tokenizer->vocab_capacity = INITIAL_VOCAB_SIZE;
     for (int i = 0; i < INITIAL_VOCAB_SIZE; ++i) {
-        tokenizer->vocab[i] = (unsigned char*)malloc(sizeof(unsigned char));
-        tokenizer->vocab[i][0] = i;
+        tokenizer->vocab[i] = i;
+        tokenizer->vocab_offsets[i] = i;
     }
+    tokenizer->vocab_offsets[INITIAL_VOCAB_SIZE] = INITIAL_VOCAB_SIZE;
     tokenizer->vocab_size = INITIAL_VOCAB_SIZE;
+    // An empty rank index with the smallest table pair_table_init() makes.
+    uint64_t *keys = (uint64_t*)arena_alloc(&tokenizer->arena, 16 * sizeof(uint64_t));
+    memset(keys, 0xff, 16 * sizeof(uint64_t));
+    tokenizer->merge_ranks = (PairTable){ keys, (size_t*)arena_alloc(&tokenizer->arena, 16 * sizeof(size_t)), NULL, 0, 16, NULL };
+    tokenizer->split_pattern = SPLIT_NONE;
+    memset(&tokenizer->specials, 0, sizeof(SpecialTokens));
+    tokenizer->specials.allocator = allocator;
+    tokenizer->mapping = NULL;
+    tokenizer->mapping_size = 0;
     return tokenizer;
 }
 
@@ -62,214 +592,5149 @@ BasicTokenizer* create_tokenizer() {
 * @param tokenizer Pointer to the BasicTokenizer to be cleaned up.
 */
 void clean_tokenizer(BasicTokenizer *tokenizer) {
-    for (size_t i = 0; i < tokenizer->vocab_size; ++i) {
-        free(tokenizer->vocab[i]);
+    special_tokens_free(&tokenizer->specials);
+    if (tokenizer->mapping) {
+        munmap(tokenizer->mapping, tokenizer->mapping_size);
     }
-    free(tokenizer->vocab);
-    free(tokenizer->merges);
-    free(tokenizer);
+    // The tokenizer itself lives in the arena, so copy the arena out first.
+    Arena arena = tokenizer->arena;
+    arena_free(&arena);
 }
 
 /*
-* @brief the tokenizer on the given text.
-*
-* Performs byte pair encoding (BPE) on the input text to learn merges
-* and expand the vocabulary up to the specified size.
+* @brief Appends a special token without rebuilding the automaton.
 *
-* @param tokenizer Pointer to the BasicTokenizer to be trained.
-* @param text The input text to train on.
-* @param vocab_size The desired final vocabulary size.
-* @param verbose If non-zero, print progress information during training.
+* @return 0 on success, -1 if the string or id is already registered or allocation fails.
 */
-void train(BasicTokenizer *tokenizer, const char *text, size_t vocab_size, int verbose) {
-    size_t num_merges = vocab_size - INITIAL_VOCAB_SIZE;
-    size_t text_size = strlen(text);
-    int *ids = (int*)malloc(text_size * sizeof(int));
-    for (size_t i = 0; i < text_size; ++i) {
-        ids[i] = (unsigned char)text[i];
+static int special_tokens_append(SpecialTokens *specials, const unsigned char *token, size_t length, int id) {
+    if (specials->by_id.capacity == 0 && pair_table_init_with_allocator(&specials->by_id, 16, specials->allocator) != 0) {
+        return -1;
+    }
+    size_t end = specials->size ? specials->offsets[specials->size] : 0;
+    for (size_t i = 0; i < specials->size; ++i) {
+        if (specials->offsets[i + 1] - specials->offsets[i] == length &&
+            memcmp(specials->bytes + specials->offsets[i], token, length) == 0) {
+            return -1;
+        }
+    }
+    size_t *index = pair_table_get(&specials->by_id, (IntPair){ id, 0 });
+    if (!index || *index != 0) {
+        return -1;
     }
 
-    tokenizer->merges = (Merge*)malloc(num_merges * sizeof(Merge));
+    unsigned char *bytes = (unsigned char*)mem_realloc(specials->allocator, specials->bytes, end + length);
+    if (bytes) {
+        specials->bytes = bytes;
+    }
+    size_t *offsets = (size_t*)mem_realloc(specials->allocator, specials->offsets, (specials->size + 2) * sizeof(size_t));
+    if (offsets) {
+        specials->offsets = offsets;
+    }
+    int *ids = (int*)mem_realloc(specials->allocator, specials->ids, (specials->size + 1) * sizeof(int));
+    if (ids) {
+        specials->ids = ids;
+    }
+    if (!bytes || !offsets || !ids) {
+        // The id stays in the table, but 0 marks it as unregistered.
+        return -1;
+    }
+    memcpy(specials->bytes + end, token, length);
+    specials->offsets[0] = 0;
+    specials->offsets[specials->size + 1] = end + length;
+    specials->ids[specials->size] = id;
+    // Stored off by one so that 0 means not a special token.
+    *index = ++specials->size;
+    return 0;
+}
 
-    for (size_t i = 0; i < num_merges; ++i) {
-        size_t pair_counts[MAX_TEXT_SIZE * 3];
-        size_t pair_counts_size;
-        token_counts(ids, text_size, pair_counts, &pair_counts_size);
+/*
+* @brief Builds the Aho-Corasick automaton over every registered special token.
+*
+* The automaton is built aside and replaces the current one only once it is
+* complete, so on failure the previous automaton is left in place.
+*
+* @return 0 on success, -1 if allocation fails.
+*/
+static int special_tokens_build(SpecialTokens *specials) {
+    const Allocator *allocator = specials->allocator;
+    size_t max_nodes = specials->offsets[specials->size] + 1;
+    SpecialTokens built = *specials;
+    memset(&built.trie, 0, sizeof(PairTable));
+    built.fail = (size_t*)mem_calloc(allocator, max_nodes, sizeof(size_t));
+    built.output = (size_t*)mem_calloc(allocator, max_nodes, sizeof(size_t));
+    built.dict = (size_t*)mem_calloc(allocator, max_nodes, sizeof(size_t));
+    built.depth = (size_t*)mem_calloc(allocator, max_nodes, sizeof(size_t));
+    size_t *parent = (size_t*)mem_alloc(allocator, max_nodes * sizeof(size_t));
+    unsigned char *byte = (unsigned char*)mem_alloc(allocator, max_nodes);
+    size_t *order = (size_t*)mem_alloc(allocator, max_nodes * sizeof(size_t));
+    size_t *starts = (size_t*)mem_calloc(allocator, max_nodes + 1, sizeof(size_t));
+    int status = built.fail && built.output && built.dict && built.depth && parent && byte &&
+                 order && starts ? pair_table_init_with_allocator(&built.trie, max_nodes, allocator) : -1;
 
-        size_t max_count = 0;
-        IntPair best_pair = { 0, 0 };
-        for (size_t j = 0; j < pair_counts_size * 3; j += 3) {
-            IntPair pair = { pair_counts[j], pair_counts[j+1] };
-            size_t count = pair_counts[j+2];
-            if (count > max_count) {
-                max_count = count;
-                best_pair = pair;
+    size_t num_nodes = 1;
+    for (size_t k = 0; k < specials->size && status == 0; ++k) {
+        size_t node = 0;
+        for (size_t i = specials->offsets[k]; i < specials->offsets[k + 1]; ++i) {
+            size_t *child = pair_table_get(&built.trie, (IntPair){ (int)node, specials->bytes[i] });
+            if (*child == 0) {
+                parent[num_nodes] = node;
+                byte[num_nodes] = specials->bytes[i];
+                built.depth[num_nodes] = built.depth[node] + 1;
+                *child = num_nodes++;
             }
+            node = *child;
         }
+        built.output[node] = k + 1;
+    }
+    built.num_nodes = num_nodes;
 
-        if (max_count == 0) {
-            break; // No more pairs to merge
+    if (status == 0) {
+        // Visit nodes in order of depth, so every fail link is known before it is followed.
+        for (size_t node = 1; node < num_nodes; ++node) {
+            starts[built.depth[node]]++;
         }
-
-        int idx = INITIAL_VOCAB_SIZE + i;
-        merge(ids, &text_size, best_pair, idx);
-        tokenizer->merges[i] = (Merge){ best_pair, idx };
-
-        tokenizer->vocab = (unsigned char**)realloc(tokenizer->vocab, (idx + 1) * sizeof(unsigned char*));
-        tokenizer->vocab[idx] = (unsigned char*)malloc(2 * sizeof(unsigned char));
-        tokenizer->vocab[idx][0] = best_pair.first;
-        tokenizer->vocab[idx][1] = best_pair.second;
-
-        if (verbose) {
-            printf("Merge %zu/%zu: (%d, %d) -> %d\n", i + 1, num_merges, best_pair.first, best_pair.second, idx);
+        for (size_t d = 1, total = 0; d <= max_nodes; ++d) {
+            size_t count = starts[d];
+            starts[d] = total;
+            total += count;
+        }
+        for (size_t node = 1; node < num_nodes; ++node) {
+            order[starts[built.depth[node]]++] = node;
+        }
+        for (size_t i = 0; i + 1 < num_nodes; ++i) {
+            size_t node = order[i];
+            size_t fail = 0;
+            if (parent[node] != 0) {
+                const size_t *next = NULL;
+                fail = built.fail[parent[node]];
+                while ((next = pair_table_find(&built.trie, (IntPair){ (int)fail, byte[node] })) == NULL && fail != 0) {
+                    fail = built.fail[fail];
+                }
+                fail = next ? *next : 0;
+            }
+            built.fail[node] = fail;
+            built.dict[node] = built.output[fail] ? fail : built.dict[fail];
         }
     }
+    mem_free(allocator, parent);
+    mem_free(allocator, byte);
+    mem_free(allocator, order);
+    mem_free(allocator, starts);
 
-    free(ids);
+    // Whichever automaton is not kept is freed.
+    SpecialTokens *dropped = status == 0 ? specials : &built;
+    pair_table_free(&dropped->trie);
+    mem_free(allocator, dropped->fail);
+    mem_free(allocator, dropped->output);
+    mem_free(allocator, dropped->dict);
+    mem_free(allocator, dropped->depth);
+    if (status == 0) {
+        *specials = built;
+    }
+    return status;
 }
 
 /*
-* @brief Encodes the given text into token IDs using the trained tokenizer.
+* @brief Finds the special token that Python's re would match first in `data`.
 *
-* @param tokenizer Pointer to the trained BasicTokenizer.
-* @param text The input text to encode.
-* @param ids Output array to store the resulting token IDs.
-* @param ids_size Pointer to store the number of token IDs generated.
+* That is the leftmost match and, among matches starting at the same byte,
+* the earliest registered token. Scanning stops as soon as no partial match in
+* progress could start at or before the best match found so far.
+*
+* @param allowed Per special token, whether it may match.
+* @return 1 with the match's start and special index set, or 0 if there is none.
 */
-void encode(BasicTokenizer *tokenizer, const char *text, int *ids, size_t *ids_size) {
-    size_t text_size = strlen(text);
-    *ids_size = text_size;
-    for (size_t i = 0; i < text_size; ++i) {
-        ids[i] = (unsigned char)text[i];
-    }
-
-    while (*ids_size >= 2) {
-        size_t pair_counts[MAX_TEXT_SIZE * 3];
-        size_t pair_counts_size;
-        token_counts(ids, *ids_size, pair_counts, &pair_counts_size);
-
-        IntPair best_pair = { -1, -1 };
-        size_t best_idx = 0;
-        size_t min_merge_idx = SIZE_MAX;
-
-        for (size_t i = 0; i < pair_counts_size * 3; i += 3) {
-            IntPair pair = { pair_counts[i], pair_counts[i+1] };
-            size_t idx = find_pair_index(tokenizer->merges, tokenizer->num_merges, pair);
-            if (idx < tokenizer->num_merges && idx < min_merge_idx) {
-                min_merge_idx = idx;
-                best_pair = pair;
-                best_idx = idx;
-            }
+static int find_special(const SpecialTokens *specials, const unsigned char *allowed,
+                        const unsigned char *data, size_t size, size_t *start, size_t *index) {
+    size_t node = 0;
+    size_t best_start = SIZE_MAX, best = 0;
+    for (size_t i = 0; i < size; ++i) {
+        const size_t *child;
+        while ((child = pair_table_find(&specials->trie, (IntPair){ (int)node, data[i] })) == NULL && node != 0) {
+            node = specials->fail[node];
         }
-
-        if (best_pair.first == -1) {
+        node = child ? *child : 0;
+        if (best_start != SIZE_MAX && i + 1 - specials->depth[node] > best_start) {
             break;
         }
-
-        merge(ids, ids_size, best_pair, tokenizer->merges[best_idx].idx);
+        // Matches ending here come longest first, so the first allowed one starts earliest.
+        for (size_t m = specials->output[node] ? node : specials->dict[node]; m != 0; m = specials->dict[m]) {
+            size_t k = specials->output[m] - 1;
+            if (!allowed[k]) {
+                continue;
+            }
+            size_t match_start = i + 1 - specials->depth[m];
+            if (match_start < best_start || (match_start == best_start && k < best)) {
+                best_start = match_start;
+                best = k;
+            }
+            break;
+        }
+    }
+    if (best_start == SIZE_MAX) {
+        return 0;
     }
+    *start = best_start;
+    *index = best;
+    return 1;
 }
 
 /*
-* @brief Decodes a list of token IDs back into text.
+* @brief Registers a special token with a fixed id.
 *
-* @param tokenizer Pointer to the BasicTokenizer used for decoding.
-* @param ids Array of token IDs to decode.
-* @param ids_size Number of token IDs in the array.
-* @param text Output buffer to store the decoded text.
+* encode_special() emits the id wherever the token's string occurs (subject
+* to its policy) instead of encoding those bytes, and decoding the id gives
+* back the string. Register special tokens after training: the id must not
+* be used by the vocab.
+*
+* @param tokenizer Pointer to the BasicTokenizer.
+* @param token The special token's string; must not be empty.
+* @param id The id to reserve for it; must be at least the vocab size.
+* @return 0 on success, -1 if the token or id is invalid or already registered, or allocation fails.
 */
-void decode(const BasicTokenizer *tokenizer, const int *ids, size_t ids_size, char *text) {
-    for (size_t i = 0; i < ids_size; ++i) {
-        text[i] = tokenizer->vocab[ids[i]][0];
+int add_special_token(BasicTokenizer *tokenizer, const char *token, int id) {
+    SpecialTokens *specials = &tokenizer->specials;
+    size_t length = strlen(token);
+    if (length == 0 || id < 0 || (size_t)id < tokenizer->vocab_size ||
+        special_tokens_append(specials, (const unsigned char*)token, length, id) != 0) {
+        return -1;
+    }
+    if (special_tokens_build(specials) != 0) {
+        // Forget the token again; its bytes past the last offset are simply unused.
+        *pair_table_get(&specials->by_id, (IntPair){ id, 0 }) = 0;
+        specials->size--;
+        return -1;
     }
-    text[ids_size] = '\0';
+    return 0;
 }
 
+/*
+* @brief Sets how text is split into chunks before training and encoding.
+*
+* With SPLIT_GPT2 or SPLIT_GPT4, text is first cut into chunks the way the
+* GPT-2 or GPT-4 (cl100k) regex would cut it, and merges are learned and
+* applied within chunks only. Set the pattern before training; a tokenizer
+* must be encoded with the pattern it was trained with.
+*
+* @param tokenizer Pointer to the BasicTokenizer.
+* @param pattern The split pattern, or SPLIT_NONE to treat the text as a single chunk.
+*/
+void set_split_pattern(BasicTokenizer *tokenizer, SplitPattern pattern) {
+    tokenizer->split_pattern = pattern;
+}
 
-/* @brief Decodes a list of token IDs back into text.
+/*
+* @brief Records a learned merge and its new token in the tokenizer.
 *
-* @param tokenizer Pointer to the BasicTokenizer used for decoding.
-* @param ids Array of token IDs to decode.
-* @param ids_size Number of token IDs in the array.
-* @param text Output buffer to store the decoded text.
+* The new token's vocab entry holds the concatenated bytes of the pair. The
+* merge list and the vocab bytes double whenever they are full, so a run of
+* merges reallocates O(log n) times.
+*
+* @param tokenizer Pointer to the BasicTokenizer being trained.
+* @param pair The pair of tokens that was merged.
+* @param idx The new token ID for the pair.
+* @return 0 on success, -1 if allocation fails.
 */
-size_t find_pair_index(Merge *merges, size_t merges_size, IntPair pair) {
-    for (size_t i = 0; i < merges_size; ++i) {
-        if (merges[i].pair.first == pair.first && merges[i].pair.second == pair.second) {
-            return i;
+static int add_merge(BasicTokenizer *tokenizer, IntPair pair, int idx) {
+    if (tokenizer->num_merges == tokenizer->merges_capacity &&
+        reserve_tokenizer(tokenizer, 2 * tokenizer->vocab_size) != 0) {
+        return -1;
+    }
+    size_t *offsets = tokenizer->vocab_offsets;
+    size_t first_size = offsets[pair.first + 1] - offsets[pair.first];
+    size_t second_size = offsets[pair.second + 1] - offsets[pair.second];
+    size_t end = offsets[idx];
+
+    if (end + first_size + second_size > tokenizer->vocab_capacity) {
+        size_t capacity = tokenizer->vocab_capacity * 2;
+        if (capacity < end + first_size + second_size) {
+            capacity = end + first_size + second_size;
         }
+        // Extends in place when the vocab is still the arena's latest allocation.
+        unsigned char *vocab = (unsigned char*)arena_grow(&tokenizer->arena, tokenizer->vocab, end, capacity);
+        if (!vocab) {
+            return -1;
+        }
+        tokenizer->vocab = vocab;
+        tokenizer->vocab_capacity = capacity;
     }
-    return merges_size;
+    unsigned char *vocab = tokenizer->vocab;
+    memcpy(vocab + end, vocab + offsets[pair.first], first_size);
+    memcpy(vocab + end + first_size, vocab + offsets[pair.second], second_size);
+    offsets[idx + 1] = end + first_size + second_size;
+    tokenizer->merges[tokenizer->num_merges++] = (Merge){ pair, idx };
+    tokenizer->generation = next_generation();
+    tokenizer->vocab_size = idx + 1;
+    return 0;
 }
 
 /*
-* @brief Counts the frequencies of consecutive token pairs in the given ID sequence.
+* @brief Checks that a tokenizer can be trained up to `vocab_size`.
 *
-* @param ids Array of token IDs.
-* @param ids_size Number of token IDs in the array.
-* @param pair_counts Output array to store pair counts (format: [first, second, count, ...]).
-* @param pair_counts_size Pointer to store the number of unique pairs found.
+* Training numbers its merges from 256 up, so it needs a tokenizer without
+* merges that is not mapped from a file, and no special token may hold an id
+* below the target vocab size.
+*
+* @return 0 if training may start, -1 otherwise.
 */
-void token_counts(const int *ids, size_t ids_size, size_t *pair_counts, size_t *pair_counts_size) {
-    *pair_counts_size = 0;
-    for (size_t i = 0; i < ids_size - 1; ++i) {
-        IntPair pair = { ids[i], ids[i + 1] };
-        size_t index = find_pair_index((Merge *)pair_counts, *pair_counts_size, pair);
-        if (index == *pair_counts_size) {
-            // New pair
-            pair_counts[*pair_counts_size * 3] = pair.first;
-            pair_counts[*pair_counts_size * 3 + 1] = pair.second;
-            pair_counts[*pair_counts_size * 3 + 2] = 1; // Initialize count to 1
-            (*pair_counts_size)++;
-        } else {
-            // Increment count
-            pair_counts[index * 3 + 2]++;
+static int check_trainable(const BasicTokenizer *tokenizer, size_t vocab_size) {
+    if (vocab_size < INITIAL_VOCAB_SIZE || vocab_size > INT_MAX || tokenizer->num_merges > 0 || tokenizer->mapping) {
+        return -1;
+    }
+    for (size_t i = 0; i < tokenizer->specials.size; ++i) {
+        if ((size_t)tokenizer->specials.ids[i] < vocab_size) {
+            return -1;
         }
     }
+    return 0;
 }
 
+/*
+* @brief the tokenizer on the given text.
+*
+* Performs byte pair encoding (BPE) on the input text to learn merges
+* and expand the vocabulary up to the specified size.
+*
+* @param tokenizer Pointer to the BasicTokenizer to be trained.
+* @param text The input text to train on.
+* @param vocab_size The desired final vocabulary size.
+* @param verbose If non-zero, print progress information during training.
+* @return 0 on success; -1 if the tokenizer cannot be trained (see check_trainable()), or if
+*         allocation fails, in which case the merges learned until then are kept.
+*/
+int train(BasicTokenizer *tokenizer, const char *text, size_t vocab_size, int verbose) {
+    return train_parallel(tokenizer, text, strlen(text), vocab_size, NULL, verbose);
+}
 
 /*
-* @brief Applies a merge operation to the given sequence of token IDs.
+* @brief Trains the tokenizer on `size` bytes of arbitrary data.
 *
-* @param ids Array of token IDs to be merged.
-* @param ids_size Pointer to the size of the ids array (will be updated after merging).
-* @param pair The pair of tokens to be merged.
-* @param idx The new token ID to replace the merged pair.
+* Same as train(), but the input is not NUL-terminated and may contain NULs.
+*
+* @param tokenizer Pointer to the BasicTokenizer to be trained.
+* @param data The bytes to train on.
+* @param size Number of bytes in data.
+* @param vocab_size The desired final vocabulary size.
+* @param verbose If non-zero, print progress information during training.
+* @return 0 on success; -1 if the tokenizer cannot be trained (see check_trainable()), or if
+*         allocation fails, in which case the merges learned until then are kept.
 */
-void merge(int *ids, size_t *ids_size, IntPair pair, int idx) {
-    int new_ids[MAX_TEXT_SIZE];
-    size_t new_ids_size = 0;
-    for (size_t i = 0; i < *ids_size; ++i) {
-        if (ids[i] == pair.first && i < *ids_size - 1 && ids[i + 1] == pair.second) {
-            new_ids[new_ids_size++] = idx;
-            ++i;  // Skip the next element
-        } else {
-            new_ids[new_ids_size++] = ids[i];
-        }
-    }
-    memcpy(ids, new_ids, new_ids_size * sizeof(int));
-    *ids_size = new_ids_size;
+int train_bytes(BasicTokenizer *tokenizer, const char *data, size_t size, size_t vocab_size, int verbose) {
+    return train_parallel(tokenizer, data, size, vocab_size, NULL, verbose);
 }
 
+/*
+* @brief Runs the merge loop of train_parallel() over an array of ids.
+*
+* Negative ids separate documents: a pair that contains one is never merged,
+* so no merge spans two documents.
+*
+* @param tokenizer Pointer to the BasicTokenizer to be trained; must pass check_trainable().
+* @param ids Array of token IDs, rewritten in place as merges are applied.
+* @param ids_size Number of token IDs in the array.
+* @param vocab_size The desired final vocabulary size.
+* @param pool Thread pool to count on, or NULL to count on the calling thread.
+* @param verbose If non-zero, print progress information during training.
+* @return 0 on success, -1 if allocation fails, in which case the merges learned until then are kept.
+*/
+static int train_ids(BasicTokenizer *tokenizer, int *ids, size_t ids_size, size_t vocab_size, ThreadPool *pool, int verbose) {
+    const Allocator *allocator = tokenizer->allocator;
+    size_t num_merges = vocab_size - INITIAL_VOCAB_SIZE;
+    if (reserve_tokenizer(tokenizer, vocab_size) != 0) {
+        return -1;
+    }
 
-int main() {
-    BasicTokenizer *tokenizer = create_tokenizer();
-    
-    const char *text = "hello world the sky is blue";
-    size_t vocab_size = 300;
+    int num_chunks = thread_pool_size(pool);
+    size_t chunk_size = ids_size / num_chunks + 1;
+    int *scratch = num_chunks > 1 ? (int*)mem_alloc(allocator, ids_size * sizeof(int)) : NULL;
+    PairTable pair_counts;
+    PairTable *chunk_counts = (PairTable*)mem_alloc(allocator, num_chunks * sizeof(PairTable));
+    // Distinct pairs are far fewer than ids, so the tables start small and grow as needed.
+    size_t expected = ids_size < COUNT_TABLE_PAIRS ? ids_size : COUNT_TABLE_PAIRS;
+    int status = pair_table_init_with_allocator(&pair_counts, expected, allocator);
+    if (!chunk_counts || (num_chunks > 1 && ids_size && !scratch)) {
+        status = -1;
+    }
+    expected = chunk_size < COUNT_TABLE_PAIRS ? chunk_size : COUNT_TABLE_PAIRS;
+    for (int c = 0; chunk_counts && c < num_chunks; ++c) {
+        status |= pair_table_init_with_allocator(&chunk_counts[c], expected, allocator);
+    }
 
-    printf("Input Text:%s\n",text);
-    train(tokenizer, text, vocab_size, 1);
+    for (size_t i = 0; i < num_merges && status == 0; ++i) {
+        if (token_counts_parallel(ids, ids_size, &pair_counts, chunk_counts, pool) != 0) {
+            status = -1;
+            break;
+        }
 
-    // Encode the text
-    int ids[MAX_TEXT_SIZE];
-    size_t ids_size = 0;
-    encode(tokenizer, text, ids, &ids_size);
+        // Pairs are visited in order of first occurrence, so ties go to the earliest pair.
+        size_t max_count = 0;
+        IntPair best_pair = { 0, 0 };
+        for (size_t j = 0; j < pair_counts.size; ++j) {
+            size_t count = pair_counts.values[pair_counts.order[j]];
+            if (count > max_count) {
+                IntPair pair = pair_table_key(&pair_counts, j);
+                if (pair.first >= 0 && pair.second >= 0) {
+                    max_count = count;
+                    best_pair = pair;
+                }
+            }
+        }
+
+        if (max_count == 0) {
+            break; // No more pairs to merge
+        }
+
+        int idx = INITIAL_VOCAB_SIZE + i;
+        merge_parallel(ids, &ids_size, best_pair, idx, scratch, pool, allocator);
+        if (add_merge(tokenizer, best_pair, idx) != 0) {
+            status = -1;
+            break;
+        }
+
+        if (verbose) {
+            printf("Merge %zu/%zu: (%d, %d) -> %d\n", i + 1, num_merges, best_pair.first, best_pair.second, idx);
+        }
+    }
+
+    for (int c = 0; chunk_counts && c < num_chunks; ++c) {
+        pair_table_free(&chunk_counts[c]);
+    }
+    mem_free(allocator, chunk_counts);
+    pair_table_free(&pair_counts);
+    mem_free(allocator, scratch);
+    if (build_merge_index(tokenizer) != 0) {
+        status = -1;
+    }
+    return status;
+}
+
+/*
+* @brief Trains the tokenizer, counting pairs on a thread pool.
+*
+* Learns exactly the same merges as a serial train(); the pair counting and
+* the rewriting of the ids after each merge are split across the pool's threads.
+* With a split pattern set, it trains on the deduplicated chunks with
+* train_words() instead.
+*
+* @param tokenizer Pointer to the BasicTokenizer to be trained.
+* @param data The bytes to train on; may contain NULs.
+* @param size Number of bytes in data.
+* @param vocab_size The desired final vocabulary size.
+* @param pool Thread pool to count on, or NULL to count on the calling thread.
+* @param verbose If non-zero, print progress information during training.
+* @return 0 on success; -1 if the tokenizer cannot be trained (see check_trainable()), or if
+*         allocation fails, in which case the merges learned until then are kept.
+*/
+int train_parallel(BasicTokenizer *tokenizer, const char *data, size_t size, size_t vocab_size, ThreadPool *pool, int verbose) {
+    if (check_trainable(tokenizer, vocab_size) != 0) {
+        return -1;
+    }
+    if (tokenizer->split_pattern != SPLIT_NONE) {
+        // Deduplicated chunks are far smaller than the text; train on them serially.
+        return train_words(tokenizer, data, size, vocab_size, verbose);
+    }
+    int *ids = (int*)mem_alloc(tokenizer->allocator, size * sizeof(int));
+    if (size && !ids) {
+        return -1;
+    }
+    for (size_t i = 0; i < size; ++i) {
+        ids[i] = (unsigned char)data[i];
+    }
+    int status = train_ids(tokenizer, ids, size, vocab_size, pool, verbose);
+    mem_free(tokenizer->allocator, ids);
+    return status;
+}
+
+static int heap_less(HeapItem a, HeapItem b) {
+    return a.key < b.key || (a.key == b.key && a.value < b.value);
+}
+
+/*
+* @brief Pushes an item onto the heap, growing it geometrically.
+*
+* @return 0 on success, -1 if allocation fails.
+*/
+static int heap_push(Heap *heap, HeapItem item) {
+    if (heap->size == heap->capacity) {
+        size_t capacity = heap->capacity ? heap->capacity * 2 : 1024;
+        HeapItem *items = (HeapItem*)mem_realloc(heap->allocator, heap->items, capacity * sizeof(HeapItem));
+        if (!items) {
+            return -1;
+        }
+        heap->items = items;
+        heap->capacity = capacity;
+    }
+    size_t i = heap->size++;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!heap_less(item, heap->items[parent])) {
+            break;
+        }
+        heap->items[i] = heap->items[parent];
+        i = parent;
+    }
+    heap->items[i] = item;
+    return 0;
+}
+
+/*
+* @brief Removes and returns the smallest item. The heap must not be empty.
+*/
+static HeapItem heap_pop(Heap *heap) {
+    HeapItem top = heap->items[0];
+    HeapItem last = heap->items[--heap->size];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= heap->size) {
+            break;
+        }
+        if (child + 1 < heap->size && heap_less(heap->items[child + 1], heap->items[child])) {
+            child++;
+        }
+        if (!heap_less(heap->items[child], last)) {
+            break;
+        }
+        heap->items[i] = heap->items[child];
+        i = child;
+    }
+    if (heap->size > 0) {
+        heap->items[i] = last;
+    }
+    return top;
+}
+
+static void train_state_free(TrainState *state) {
+    const Allocator *allocator = state->allocator;
+    mem_free(allocator, state->tokens);
+    mem_free(allocator, state->prev);
+    mem_free(allocator, state->next);
+    mem_free(allocator, state->occ_prev);
+    mem_free(allocator, state->occ_next);
+    mem_free(allocator, state->stats);
+    mem_free(allocator, state->touched);
+    mem_free(allocator, state->queue.items);
+    mem_free(allocator, state->positions);
+    mem_free(allocator, state->weights);
+    pair_table_free(&state->pair_index);
+}
+
+static size_t train_state_weight(const TrainState *state, size_t node) {
+    return state->weights ? state->weights[node] : 1;
+}
+
+/*
+* @brief Adds the pair starting at `node` to its occurrence list.
+*
+* The pair is not queued yet; train_state_queue() does that once for every
+* pair linked since its last call.
+*
+* @return 0 on success, -1 if allocation fails.
+*/
+static int train_state_link(TrainState *state, size_t node) {
+    IntPair pair = { state->tokens[node], state->tokens[state->next[node]] };
+    size_t *index = pair_table_get(&state->pair_index, pair);
+    if (!index) {
+        return -1;
+    }
+    if (*index == 0) {
+        // New pair: table values are stored off by one so that 0 means unassigned.
+        if (state->num_stats == state->stats_capacity) {
+            size_t capacity = state->stats_capacity ? state->stats_capacity * 2 : 1024;
+            size_t *touched = (size_t*)mem_realloc(state->allocator, state->touched, capacity * sizeof(size_t));
+            if (!touched) {
+                return -1;
+            }
+            state->touched = touched;
+            PairStats *stats = (PairStats*)mem_realloc(state->allocator, state->stats, capacity * sizeof(PairStats));
+            if (!stats) {
+                return -1;
+            }
+            state->stats = stats;
+            state->stats_capacity = capacity;
+        }
+        state->stats[state->num_stats] = (PairStats){ pair, 0, NO_NODE, NO_NODE, 0, 0 };
+        *index = ++state->num_stats;
+    }
+
+    PairStats *stats = &state->stats[*index - 1];
+    state->occ_prev[node] = NO_NODE;
+    state->occ_next[node] = stats->head;
+    if (stats->head != NO_NODE) {
+        state->occ_prev[stats->head] = node;
+    }
+    stats->head = node;
+    stats->count += train_state_weight(state, node);
+    if (node < stats->first) {
+        stats->first = node;
+        stats->first_stale = 0;
+    }
+    if (!stats->touched) {
+        stats->touched = 1;
+        state->touched[state->num_touched++] = *index - 1;
+    }
+    return 0;
+}
+
+/*
+* @brief Queues every pair linked since the last call with its current count and leftmost node.
+*
+* Counts only go up and `first` only down between calls, so a touched pair may
+* now rank higher than its queued entries; untouched pairs can only have
+* dropped, which train_state_pop() catches lazily.
+*
+* @return 0 on success, -1 if allocation fails.
+*/
+static int train_state_queue(TrainState *state) {
+    for (size_t k = 0; k < state->num_touched; ++k) {
+        PairStats *stats = &state->stats[state->touched[k]];
+        stats->touched = 0;
+        if (stats->count > 0 &&
+            heap_push(&state->queue, (HeapItem){ SIZE_MAX - stats->count, stats->first, state->touched[k] }) != 0) {
+            state->num_touched = 0;
+            return -1;
+        }
+    }
+    state->num_touched = 0;
+    return 0;
+}
+
+/*
+* @brief Removes the pair starting at `node` from its occurrence list.
+*/
+static void train_state_unlink(TrainState *state, size_t node) {
+    IntPair pair = { state->tokens[node], state->tokens[state->next[node]] };
+    PairStats *stats = &state->stats[*pair_table_find(&state->pair_index, pair) - 1];
+    if (state->occ_prev[node] != NO_NODE) {
+        state->occ_next[state->occ_prev[node]] = state->occ_next[node];
+    } else {
+        stats->head = state->occ_next[node];
+    }
+    if (state->occ_next[node] != NO_NODE) {
+        state->occ_prev[state->occ_next[node]] = state->occ_prev[node];
+    }
+    stats->count -= train_state_weight(state, node);
+    if (node == stats->first) {
+        stats->first_stale = 1;
+    }
+}
+
+/*
+* @brief Builds the linked token list and initial pair counts for a set of byte segments.
+*
+* @param weights Number of occurrences each segment stands for, or NULL to count every segment once.
+* @param allocator Memory functions for the state, or NULL for the C library.
+* @return 0 on success, -1 if allocation fails.
+*/
+static int train_state_init(TrainState *state, const char *const *segments, const size_t *sizes,
+                            const size_t *weights, size_t num_segments, const Allocator *allocator) {
+    size_t text_size = 0;
+    for (size_t s = 0; s < num_segments; ++s) {
+        text_size += sizes[s];
+    }
+
+    memset(state, 0, sizeof(TrainState));
+    state->allocator = allocator;
+    state->queue.allocator = allocator;
+    state->num_nodes = text_size;
+    state->tokens = (int*)mem_alloc(allocator, text_size * sizeof(int));
+    state->prev = (size_t*)mem_alloc(allocator, text_size * sizeof(size_t));
+    state->next = (size_t*)mem_alloc(allocator, text_size * sizeof(size_t));
+    state->occ_prev = (size_t*)mem_alloc(allocator, text_size * sizeof(size_t));
+    state->occ_next = (size_t*)mem_alloc(allocator, text_size * sizeof(size_t));
+    state->positions = (size_t*)mem_alloc(allocator, text_size * sizeof(size_t));
+    if (weights) {
+        state->weights = (size_t*)mem_alloc(allocator, text_size * sizeof(size_t));
+    }
+    if ((text_size && (!state->tokens || !state->prev || !state->next ||
+                       !state->occ_prev || !state->occ_next || !state->positions ||
+                       (weights && !state->weights))) ||
+        pair_table_init_with_allocator(&state->pair_index, 1024, allocator) != 0) {
+        train_state_free(state);
+        return -1;
+    }
+
+    // Segments are laid out back to back but not linked, so no pair spans two of them.
+    size_t start = 0;
+    for (size_t s = 0; s < num_segments; ++s) {
+        size_t end = start + sizes[s];
+        for (size_t i = start; i < end; ++i) {
+            state->tokens[i] = (unsigned char)segments[s][i - start];
+            state->prev[i] = i > start ? i - 1 : NO_NODE;
+            state->next[i] = i + 1 < end ? i + 1 : NO_NODE;
+            if (weights) {
+                state->weights[i] = weights[s];
+            }
+        }
+        start = end;
+    }
+    for (size_t i = 0; i < text_size; ++i) {
+        if (state->next[i] != NO_NODE && train_state_link(state, i) != 0) {
+            train_state_free(state);
+            return -1;
+        }
+    }
+    if (train_state_queue(state) != 0) {
+        train_state_free(state);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+* @brief Pops the most frequent pair from the queue.
+*
+* The queue is a min-heap keyed by (SIZE_MAX - count, leftmost node), so the
+* highest count comes first and ties go to the pair whose leftmost live
+* occurrence comes first, as in train(). Every live pair has an entry whose
+* key is no larger than its current one; entries that turn out to be too
+* small are re-queued with the current key, and the rest are dropped.
+*
+* @param state Pointer to the TrainState.
+* @param pair Receives the most frequent pair.
+* @param count Receives the pair's count, or 0 if no pair occurs any more.
+* @return 0 on success, -1 if allocation fails.
+*/
+static int train_state_pop(TrainState *state, IntPair *pair, size_t *count) {
+    *count = 0;
+    while (state->queue.size > 0) {
+        HeapItem item = heap_pop(&state->queue);
+        PairStats *stats = &state->stats[item.tag];
+        size_t queued = SIZE_MAX - item.key;
+        if (stats->count == 0 || stats->count > queued) {
+            continue; // a newer entry holds the current count
+        }
+        if (stats->count == queued) {
+            if (stats->first_stale) {
+                stats->first = NO_NODE;
+                for (size_t node = stats->head; node != NO_NODE; node = state->occ_next[node]) {
+                    if (node < stats->first) {
+                        stats->first = node;
+                    }
+                }
+                stats->first_stale = 0;
+            }
+            if (stats->first == item.value) {
+                *pair = stats->pair;
+                *count = queued;
+                return 0;
+            }
+            if (stats->first < item.value) {
+                continue; // a newer entry holds the current leftmost node
+            }
+        }
+        if (heap_push(&state->queue, (HeapItem){ SIZE_MAX - stats->count, stats->first, item.tag }) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int compare_positions(const void *a, const void *b) {
+    size_t x = *(const size_t*)a;
+    size_t y = *(const size_t*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+* @brief Merges every occurrence of a pair and updates the neighbouring pair counts.
+*
+* Occurrences are applied left to right, matching merge(), so overlapping
+* runs such as "aaa" resolve the same way as in train().
+*
+* @param state Pointer to the TrainState.
+* @param pair The pair of tokens to be merged.
+* @param idx The new token ID to replace the merged pair.
+* @return 0 on success, -1 if allocation fails.
+*/
+static int train_state_merge(TrainState *state, IntPair pair, int idx) {
+    size_t num_positions = 0;
+    size_t stats_index = *pair_table_find(&state->pair_index, pair) - 1;
+    for (size_t node = state->stats[stats_index].head; node != NO_NODE; node = state->occ_next[node]) {
+        state->positions[num_positions++] = node;
+    }
+    qsort(state->positions, num_positions, sizeof(size_t), compare_positions);
+
+    for (size_t k = 0; k < num_positions; ++k) {
+        size_t i = state->positions[k];
+        size_t j = state->next[i];
+        // An earlier merge in this pass may have consumed this occurrence.
+        if (state->tokens[i] != pair.first || j == NO_NODE || state->tokens[j] != pair.second) {
+            continue;
+        }
+        size_t p = state->prev[i];
+        size_t q = state->next[j];
+
+        if (p != NO_NODE) {
+            train_state_unlink(state, p);
+        }
+        train_state_unlink(state, i);
+        if (q != NO_NODE) {
+            train_state_unlink(state, j);
+        }
+
+        state->tokens[i] = idx;
+        state->tokens[j] = -1;
+        state->next[i] = q;
+        if (q != NO_NODE) {
+            state->prev[q] = i;
+        }
+
+        if (p != NO_NODE && train_state_link(state, p) != 0) {
+            return -1;
+        }
+        if (q != NO_NODE && train_state_link(state, i) != 0) {
+            return -1;
+        }
+    }
+    return train_state_queue(state);
+}
+
+/*
+* @brief Runs the incremental merge loop over a prepared TrainState.
+*
+* @param tokenizer Pointer to the BasicTokenizer to be trained.
+* @param state Pointer to a TrainState holding the training data.
+* @param vocab_size The desired final vocabulary size.
+* @param verbose If non-zero, print progress information during training.
+* @return 0 on success; -1 if the tokenizer cannot be trained (see check_trainable()), or if
+*         allocation fails, in which case the merges learned until then are kept.
+*/
+static int train_from_state(BasicTokenizer *tokenizer, TrainState *state, size_t vocab_size, int verbose) {
+    if (check_trainable(tokenizer, vocab_size) != 0) {
+        return -1;
+    }
+    size_t num_merges = vocab_size - INITIAL_VOCAB_SIZE;
+    if (reserve_tokenizer(tokenizer, vocab_size) != 0) {
+        return -1;
+    }
+
+    int status = 0;
+    for (size_t i = 0; i < num_merges; ++i) {
+        IntPair best_pair = { 0, 0 };
+        size_t max_count = 0;
+        if (train_state_pop(state, &best_pair, &max_count) != 0) {
+            status = -1;
+            break;
+        }
+
+        if (max_count == 0) {
+            break; // No more pairs to merge
+        }
+
+        int idx = INITIAL_VOCAB_SIZE + i;
+        if (train_state_merge(state, best_pair, idx) != 0 || add_merge(tokenizer, best_pair, idx) != 0) {
+            status = -1;
+            break;
+        }
+
+        if (verbose) {
+            printf("Merge %zu/%zu: (%d, %d) -> %d\n", i + 1, num_merges, best_pair.first, best_pair.second, idx);
+        }
+    }
+
+    if (build_merge_index(tokenizer) != 0) {
+        status = -1;
+    }
+    return status;
+}
+
+/*
+* @brief Trains the tokenizer while keeping pair counts live between merges.
+*
+* Produces the same kind of merges as train(), but instead of recounting
+* every pair after each merge it only updates the pairs next to the merged
+* occurrences. Ties between equally frequent pairs go to the pair whose
+* leftmost occurrence comes first, so the merges are the same as train()'s.
+* With a split pattern set, it trains on the deduplicated chunks with
+* train_words() instead.
+*
+* @param tokenizer Pointer to the BasicTokenizer to be trained.
+* @param data The bytes to train on; may contain NULs.
+* @param size Number of bytes in data.
+* @param vocab_size The desired final vocabulary size.
+* @param verbose If non-zero, print progress information during training.
+* @return 0 on success; -1 if the tokenizer cannot be trained (see check_trainable()), or if
+*         allocation fails, in which case the merges learned until then are kept.
+*/
+int train_incremental(BasicTokenizer *tokenizer, const char *data, size_t size, size_t vocab_size, int verbose) {
+    if (tokenizer->split_pattern != SPLIT_NONE) {
+        return train_words(tokenizer, data, size, vocab_size, verbose);
+    }
+    TrainState state;
+    if (train_state_init(&state, &data, &size, NULL, 1, tokenizer->allocator) != 0) {
+        return -1;
+    }
+    int status = train_from_state(tokenizer, &state, vocab_size, verbose);
+    train_state_free(&state);
+    return status;
+}
+
+static void chunk_table_free(ChunkTable *table) {
+    const Allocator *allocator = table->allocator;
+    mem_free(allocator, table->bytes);
+    mem_free(allocator, table->offsets);
+    mem_free(allocator, table->lengths);
+    mem_free(allocator, table->counts);
+    mem_free(allocator, table->slots);
+    memset(table, 0, sizeof(ChunkTable));
+    table->allocator = allocator;
+}
+
+/*
+* @brief Initializes an empty ChunkTable with room for `capacity` slots (a power of two).
+*
+* @return 0 on success, -1 if allocation fails.
+*/
+static int chunk_table_init(ChunkTable *table, size_t capacity, const Allocator *allocator) {
+    memset(table, 0, sizeof(ChunkTable));
+    table->allocator = allocator;
+    table->slots = (size_t*)mem_calloc(allocator, capacity, sizeof(size_t));
+    if (!table->slots) {
+        return -1;
+    }
+    table->capacity = capacity;
+    return 0;
+}
+
+static uint64_t hash_bytes(const unsigned char *data, size_t size) {
+    // FNV-1a
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+* @brief Finds the slot holding `data`, or the empty slot where it would go.
+*/
+static size_t chunk_table_slot(const ChunkTable *table, const unsigned char *data, size_t size) {
+    size_t mask = table->capacity - 1;
+    size_t slot = (size_t)hash_bytes(data, size) & mask;
+    while (table->slots[slot] != 0) {
+        size_t entry = table->slots[slot] - 1;
+        if (table->lengths[entry] == size &&
+            memcmp(table->bytes + table->offsets[entry], data, size) == 0) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/*
+* @brief Adds `count` occurrences of a byte string, copying it in if it is new.
+*
+* @return 0 on success, -1 if allocation fails.
+*/
+static int chunk_table_add(ChunkTable *table, const unsigned char *data, size_t size, size_t count) {
+    size_t slot = chunk_table_slot(table, data, size);
+    if (table->slots[slot] != 0) {
+        table->counts[table->slots[slot] - 1] += count;
+        return 0;
+    }
+
+    if (table->size == table->entries_capacity) {
+        size_t capacity = table->entries_capacity ? table->entries_capacity * 2 : 1024;
+        size_t *offsets = (size_t*)mem_realloc(table->allocator, table->offsets, capacity * sizeof(size_t));
+        if (offsets) {
+            table->offsets = offsets;
+        }
+        size_t *lengths = (size_t*)mem_realloc(table->allocator, table->lengths, capacity * sizeof(size_t));
+        if (lengths) {
+            table->lengths = lengths;
+        }
+        size_t *counts = (size_t*)mem_realloc(table->allocator, table->counts, capacity * sizeof(size_t));
+        if (counts) {
+            table->counts = counts;
+        }
+        if (!offsets || !lengths || !counts) {
+            return -1;
+        }
+        table->entries_capacity = capacity;
+    }
+    if (table->bytes_capacity - table->bytes_size < size) {
+        size_t capacity = table->bytes_capacity ? table->bytes_capacity : 4096;
+        while (capacity - table->bytes_size < size) {
+            capacity *= 2;
+        }
+        unsigned char *bytes = (unsigned char*)mem_realloc(table->allocator, table->bytes, capacity);
+        if (!bytes) {
+            return -1;
+        }
+        table->bytes = bytes;
+        table->bytes_capacity = capacity;
+    }
+
+    memcpy(table->bytes + table->bytes_size, data, size);
+    table->offsets[table->size] = table->bytes_size;
+    table->lengths[table->size] = size;
+    table->counts[table->size] = count;
+    table->bytes_size += size;
+    table->slots[slot] = ++table->size;
+
+    if (table->size * 2 > table->capacity) {
+        // Grow at half load and re-insert every entry into the larger index.
+        size_t *slots = (size_t*)mem_calloc(table->allocator, table->capacity * 2, sizeof(size_t));
+        if (!slots) {
+            return -1;
+        }
+        mem_free(table->allocator, table->slots);
+        table->slots = slots;
+        table->capacity *= 2;
+        for (size_t entry = 0; entry < table->size; ++entry) {
+            size_t at = chunk_table_slot(table, table->bytes + table->offsets[entry], table->lengths[entry]);
+            table->slots[at] = entry + 1;
+        }
+    }
+    return 0;
+}
+
+static int is_space_byte(unsigned char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/*
+* @brief Returns the length of the word chunk at the start of `data`.
+*
+* A chunk is a run of non-whitespace bytes with at most one leading space,
+* or a run of whitespace. A space directly before a word is left for that
+* word, so "hello  world" splits into "hello", " " and " world".
+*/
+static size_t word_length(const unsigned char *data, size_t size) {
+    size_t i = 0;
+    while (i < size && is_space_byte(data[i])) {
+        i++;
+    }
+    if (i > 0 && (i == size || data[i - 1] != ' ')) {
+        return i;
+    }
+    if (i > 1) {
+        return i - 1;
+    }
+    while (i < size && !is_space_byte(data[i])) {
+        i++;
+    }
+    return i;
+}
+
+/*
+* @brief Returns how many trailing bytes form an incomplete but so far valid UTF-8 sequence.
+*/
+static size_t utf8_incomplete_suffix(const unsigned char *bytes, size_t length) {
+    for (size_t k = 1; k <= 3 && k <= length; ++k) {
+        unsigned char c = bytes[length - k];
+        if ((c & 0xc0) == 0x80) {
+            continue;
+        }
+        size_t need = c >= 0xc2 && c <= 0xdf ? 2 : c >= 0xe0 && c <= 0xef ? 3 : c >= 0xf0 && c <= 0xf4 ? 4 : 0;
+        if (need <= k) {
+            return 0;
+        }
+        if (k >= 2) {
+            unsigned char next = bytes[length - k + 1];
+            unsigned char lo = c == 0xe0 ? 0xa0 : c == 0xf0 ? 0x90 : 0x80;
+            unsigned char hi = c == 0xed ? 0x9f : c == 0xf4 ? 0x8f : 0xbf;
+            if (next < lo || next > hi) {
+                return 0;
+            }
+        }
+        return k;
+    }
+    return 0;
+}
+
+/*
+* @brief Decodes the UTF-8 character at the start of `bytes`.
+*
+* @return The character's length in bytes, or 0 if it is invalid or incomplete.
+*/
+static size_t utf8_decode(const unsigned char *bytes, size_t length, uint32_t *cp) {
+    unsigned char c = bytes[0];
+    if (c < 0x80) {
+        *cp = c;
+        return 1;
+    }
+    size_t need = c >= 0xc2 && c <= 0xdf ? 2 : c >= 0xe0 && c <= 0xef ? 3 : c >= 0xf0 && c <= 0xf4 ? 4 : 0;
+    if (need == 0 || need > length) {
+        return 0;
+    }
+    uint32_t value = need == 2 ? c & 0x1f : need == 3 ? c & 0x0f : c & 0x07;
+    for (size_t i = 1; i < need; ++i) {
+        unsigned char lo = 0x80, hi = 0xbf;
+        if (i == 1) {
+            lo = c == 0xe0 ? 0xa0 : c == 0xf0 ? 0x90 : 0x80;
+            hi = c == 0xed ? 0x9f : c == 0xf4 ? 0x8f : 0xbf;
+        }
+        if (bytes[i] < lo || bytes[i] > hi) {
+            return 0;
+        }
+        value = (value << 6) | (bytes[i] & 0x3f);
+    }
+    *cp = value;
+    return need;
+}
+
+enum { CHAR_END, CHAR_LETTER, CHAR_NUMBER, CHAR_SPACE, CHAR_OTHER };
+
+// \p{L}, \p{N} and \s as the Python regex module used by minbpe matches them,
+// generated by tools/unicode_tables.py, which tests every code point against
+// the three classes. Letters and numbers do not overlap, and code points in no
+// table are neither.
+static const uint32_t letter_ranges[][2] = {
+    { 0x41, 0x5a }, { 0x61, 0x7a }, { 0xaa, 0xaa }, { 0xb5, 0xb5 }, { 0xba, 0xba }, { 0xc0, 0xd6 }, { 0xd8, 0xf6 },
+    { 0xf8, 0x2c1 }, { 0x2c6, 0x2d1 }, { 0x2e0, 0x2e4 }, { 0x2ec, 0x2ec }, { 0x2ee, 0x2ee }, { 0x370, 0x374 },
+    { 0x376, 0x377 }, { 0x37a, 0x37d }, { 0x37f, 0x37f }, { 0x386, 0x386 }, { 0x388, 0x38a }, { 0x38c, 0x38c },
+    { 0x38e, 0x3a1 }, { 0x3a3, 0x3f5 }, { 0x3f7, 0x481 }, { 0x48a, 0x52f }, { 0x531, 0x556 }, { 0x558, 0x559 },
+    { 0x560, 0x588 }, { 0x58b, 0x58c }, { 0x5d0, 0x5ea }, { 0x5ef, 0x5f2 }, { 0x620, 0x64a }, { 0x66e, 0x66f },
+    { 0x671, 0x6d3 }, { 0x6d5, 0x6d5 }, { 0x6e5, 0x6e6 }, { 0x6ee, 0x6ef }, { 0x6fa, 0x6fc }, { 0x6ff, 0x6ff },
+    { 0x710, 0x710 }, { 0x712, 0x72f }, { 0x74d, 0x7a5 }, { 0x7b1, 0x7b1 }, { 0x7ca, 0x7ea }, { 0x7f4, 0x7f5 },
+    { 0x7fa, 0x7fa }, { 0x800, 0x815 }, { 0x81a, 0x81a }, { 0x824, 0x824 }, { 0x828, 0x828 }, { 0x840, 0x858 },
+    { 0x860, 0x86a }, { 0x870, 0x887 }, { 0x889, 0x88f }, { 0x8a0, 0x8c9 }, { 0x904, 0x939 }, { 0x93d, 0x93d },
+    { 0x950, 0x950 }, { 0x958, 0x961 }, { 0x971, 0x980 }, { 0x985, 0x98c }, { 0x98f, 0x990 }, { 0x993, 0x9a8 },
+    { 0x9aa, 0x9b0 }, { 0x9b2, 0x9b2 }, { 0x9b6, 0x9b9 }, { 0x9bd, 0x9bd }, { 0x9ce, 0x9ce }, { 0x9dc, 0x9dd },
+    { 0x9df, 0x9e1 }, { 0x9f0, 0x9f1 }, { 0x9fc, 0x9fc }, { 0xa05, 0xa0a }, { 0xa0f, 0xa10 }, { 0xa13, 0xa28 },
+    { 0xa2a, 0xa30 }, { 0xa32, 0xa33 }, { 0xa35, 0xa36 }, { 0xa38, 0xa39 }, { 0xa59, 0xa5c }, { 0xa5e, 0xa5e },
+    { 0xa72, 0xa74 }, { 0xa85, 0xa8d }, { 0xa8f, 0xa91 }, { 0xa93, 0xaa8 }, { 0xaaa, 0xab0 }, { 0xab2, 0xab3 },
+    { 0xab5, 0xab9 }, { 0xabd, 0xabd }, { 0xad0, 0xad0 }, { 0xae0, 0xae1 }, { 0xaf9, 0xaf9 }, { 0xb05, 0xb0c },
+    { 0xb0f, 0xb10 }, { 0xb13, 0xb28 }, { 0xb2a, 0xb30 }, { 0xb32, 0xb33 }, { 0xb35, 0xb39 }, { 0xb3d, 0xb3d },
+    { 0xb5c, 0xb5d }, { 0xb5f, 0xb61 }, { 0xb71, 0xb71 }, { 0xb83, 0xb83 }, { 0xb85, 0xb8a }, { 0xb8e, 0xb90 },
+    { 0xb92, 0xb95 }, { 0xb99, 0xb9a }, { 0xb9c, 0xb9c }, { 0xb9e, 0xb9f }, { 0xba3, 0xba4 }, { 0xba8, 0xbaa },
+    { 0xbae, 0xbb9 }, { 0xbd0, 0xbd0 }, { 0xc05, 0xc0c }, { 0xc0e, 0xc10 }, { 0xc12, 0xc28 }, { 0xc2a, 0xc39 },
+    { 0xc3d, 0xc3d }, { 0xc58, 0xc5a }, { 0xc5c, 0xc5d }, { 0xc60, 0xc61 }, { 0xc80, 0xc80 }, { 0xc85, 0xc8c },
+    { 0xc8e, 0xc90 }, { 0xc92, 0xca8 }, { 0xcaa, 0xcb3 }, { 0xcb5, 0xcb9 }, { 0xcbd, 0xcbd }, { 0xcdc, 0xcde },
+    { 0xce0, 0xce1 }, { 0xcf1, 0xcf2 }, { 0xd04, 0xd0c }, { 0xd0e, 0xd10 }, { 0xd12, 0xd3a }, { 0xd3d, 0xd3d },
+    { 0xd4e, 0xd4e }, { 0xd54, 0xd56 }, { 0xd5f, 0xd61 }, { 0xd7a, 0xd7f }, { 0xd85, 0xd96 }, { 0xd9a, 0xdb1 },
+    { 0xdb3, 0xdbb }, { 0xdbd, 0xdbd }, { 0xdc0, 0xdc6 }, { 0xe01, 0xe30 }, { 0xe32, 0xe33 }, { 0xe40, 0xe46 },
+    { 0xe81, 0xe82 }, { 0xe84, 0xe84 }, { 0xe86, 0xe8a }, { 0xe8c, 0xea3 }, { 0xea5, 0xea5 }, { 0xea7, 0xeb0 },
+    { 0xeb2, 0xeb3 }, { 0xebd, 0xebd }, { 0xec0, 0xec4 }, { 0xec6, 0xec6 }, { 0xedc, 0xedf }, { 0xf00, 0xf00 },
+    { 0xf40, 0xf47 }, { 0xf49, 0xf6c }, { 0xf88, 0xf8c }, { 0x1000, 0x102a }, { 0x103f, 0x103f },
+    { 0x1050, 0x1055 }, { 0x105a, 0x105d }, { 0x1061, 0x1061 }, { 0x1065, 0x1066 }, { 0x106e, 0x1070 },
+    { 0x1075, 0x1081 }, { 0x108e, 0x108e }, { 0x10a0, 0x10c5 }, { 0x10c7, 0x10c7 }, { 0x10cd, 0x10cd },
+    { 0x10d0, 0x10fa }, { 0x10fc, 0x1248 }, { 0x124a, 0x124d }, { 0x1250, 0x1256 }, { 0x1258, 0x1258 },
+    { 0x125a, 0x125d }, { 0x1260, 0x1288 }, { 0x128a, 0x128d }, { 0x1290, 0x12b0 }, { 0x12b2, 0x12b5 },
+    { 0x12b8, 0x12be }, { 0x12c0, 0x12c0 }, { 0x12c2, 0x12c5 }, { 0x12c8, 0x12d6 }, { 0x12d8, 0x1310 },
+    { 0x1312, 0x1315 }, { 0x1318, 0x135a }, { 0x1380, 0x138f }, { 0x13a0, 0x13f5 }, { 0x13f8, 0x13fd },
+    { 0x1401, 0x166c }, { 0x166f, 0x167f }, { 0x1681, 0x169a }, { 0x16a0, 0x16ea }, { 0x16f1, 0x16f8 },
+    { 0x1700, 0x1711 }, { 0x171f, 0x1731 }, { 0x1740, 0x1751 }, { 0x1760, 0x176c }, { 0x176e, 0x1770 },
+    { 0x1780, 0x17b3 }, { 0x17d7, 0x17d7 }, { 0x17dc, 0x17dc }, { 0x1820, 0x1878 }, { 0x1880, 0x1884 },
+    { 0x1887, 0x18a8 }, { 0x18aa, 0x18aa }, { 0x18b0, 0x18f5 }, { 0x1900, 0x191e }, { 0x1950, 0x196d },
+    { 0x1970, 0x1974 }, { 0x1980, 0x19ab }, { 0x19b0, 0x19c9 }, { 0x1a00, 0x1a16 }, { 0x1a20, 0x1a54 },
+    { 0x1aa7, 0x1aa7 }, { 0x1b05, 0x1b33 }, { 0x1b45, 0x1b4c }, { 0x1b83, 0x1ba0 }, { 0x1bae, 0x1baf },
+    { 0x1bba, 0x1be5 }, { 0x1c00, 0x1c23 }, { 0x1c4d, 0x1c4f }, { 0x1c5a, 0x1c7d }, { 0x1c80, 0x1c8a },
+    { 0x1c90, 0x1cba }, { 0x1cbd, 0x1cbf }, { 0x1ce9, 0x1cec }, { 0x1cee, 0x1cf3 }, { 0x1cf5, 0x1cf6 },
+    { 0x1cfa, 0x1cfa }, { 0x1d00, 0x1dbf }, { 0x1e00, 0x1f15 }, { 0x1f18, 0x1f1d }, { 0x1f20, 0x1f45 },
+    { 0x1f48, 0x1f4d }, { 0x1f50, 0x1f57 }, { 0x1f59, 0x1f59 }, { 0x1f5b, 0x1f5b }, { 0x1f5d, 0x1f5d },
+    { 0x1f5f, 0x1f7d }, { 0x1f80, 0x1fb4 }, { 0x1fb6, 0x1fbc }, { 0x1fbe, 0x1fbe }, { 0x1fc2, 0x1fc4 },
+    { 0x1fc6, 0x1fcc }, { 0x1fd0, 0x1fd3 }, { 0x1fd6, 0x1fdb }, { 0x1fe0, 0x1fec }, { 0x1ff2, 0x1ff4 },
+    { 0x1ff6, 0x1ffc }, { 0x2071, 0x2071 }, { 0x207f, 0x207f }, { 0x208f, 0x209f }, { 0x2102, 0x2102 },
+    { 0x2107, 0x2107 }, { 0x210a, 0x2113 }, { 0x2115, 0x2115 }, { 0x2119, 0x211d }, { 0x2124, 0x2124 },
+    { 0x2126, 0x2126 }, { 0x2128, 0x2128 }, { 0x212a, 0x212d }, { 0x212f, 0x2139 }, { 0x213c, 0x213f },
+    { 0x2145, 0x2149 }, { 0x214e, 0x214e }, { 0x2183, 0x2184 }, { 0x2c00, 0x2ce4 }, { 0x2ceb, 0x2cee },
+    { 0x2cf2, 0x2cf3 }, { 0x2d00, 0x2d25 }, { 0x2d27, 0x2d27 }, { 0x2d2d, 0x2d2d }, { 0x2d30, 0x2d67 },
+    { 0x2d6f, 0x2d6f }, { 0x2d80, 0x2d96 }, { 0x2da0, 0x2da6 }, { 0x2da8, 0x2dae }, { 0x2db0, 0x2db6 },
+    { 0x2db8, 0x2dbe }, { 0x2dc0, 0x2dc6 }, { 0x2dc8, 0x2dce }, { 0x2dd0, 0x2dd6 }, { 0x2dd8, 0x2dde },
+    { 0x2e2f, 0x2e2f }, { 0x3005, 0x3006 }, { 0x3031, 0x3035 }, { 0x303b, 0x303c }, { 0x3041, 0x3096 },
+    { 0x309d, 0x309f }, { 0x30a1, 0x30fa }, { 0x30fc, 0x30ff }, { 0x3105, 0x312f }, { 0x3131, 0x318e },
+    { 0x31a0, 0x31bf }, { 0x31f0, 0x31ff }, { 0x3400, 0x4dbf }, { 0x4e00, 0xa48c }, { 0xa4d0, 0xa4fd },
+    { 0xa500, 0xa60c }, { 0xa610, 0xa61f }, { 0xa62a, 0xa62b }, { 0xa640, 0xa66e }, { 0xa67f, 0xa69d },
+    { 0xa6a0, 0xa6e5 }, { 0xa717, 0xa71f }, { 0xa722, 0xa788 }, { 0xa78b, 0xa7dd }, { 0xa7e2, 0xa7e2 },
+    { 0xa7f1, 0xa801 }, { 0xa803, 0xa805 }, { 0xa807, 0xa80a }, { 0xa80c, 0xa822 }, { 0xa840, 0xa873 },
+    { 0xa882, 0xa8b3 }, { 0xa8f2, 0xa8f7 }, { 0xa8fb, 0xa8fb }, { 0xa8fd, 0xa8fe }, { 0xa90a, 0xa925 },
+    { 0xa930, 0xa946 }, { 0xa960, 0xa97c }, { 0xa984, 0xa9b2 }, { 0xa9cf, 0xa9cf }, { 0xa9e0, 0xa9e4 },
+    { 0xa9e6, 0xa9ef }, { 0xa9fa, 0xa9fe }, { 0xaa00, 0xaa28 }, { 0xaa40, 0xaa42 }, { 0xaa44, 0xaa4b },
+    { 0xaa60, 0xaa76 }, { 0xaa7a, 0xaa7a }, { 0xaa7e, 0xaaaf }, { 0xaab1, 0xaab1 }, { 0xaab5, 0xaab6 },
+    { 0xaab9, 0xaabd }, { 0xaac0, 0xaac0 }, { 0xaac2, 0xaac2 }, { 0xaadb, 0xaadd }, { 0xaae0, 0xaaea },
+    { 0xaaf2, 0xaaf4 }, { 0xab01, 0xab06 }, { 0xab09, 0xab0e }, { 0xab11, 0xab16 }, { 0xab20, 0xab26 },
+    { 0xab28, 0xab2e }, { 0xab30, 0xab5a }, { 0xab5c, 0xab69 }, { 0xab6c, 0xab6d }, { 0xab70, 0xabe2 },
+    { 0xac00, 0xd7a3 }, { 0xd7b0, 0xd7c6 }, { 0xd7cb, 0xd7fb }, { 0xf900, 0xfa6d }, { 0xfa70, 0xfad9 },
+    { 0xfb00, 0xfb06 }, { 0xfb13, 0xfb17 }, { 0xfb1d, 0xfb1d }, { 0xfb1f, 0xfb28 }, { 0xfb2a, 0xfb36 },
+    { 0xfb38, 0xfb3c }, { 0xfb3e, 0xfb3e }, { 0xfb40, 0xfb41 }, { 0xfb43, 0xfb44 }, { 0xfb46, 0xfbb1 },
+    { 0xfbd3, 0xfd3d }, { 0xfd50, 0xfd8f }, { 0xfd92, 0xfdc7 }, { 0xfdf0, 0xfdfb }, { 0xfe70, 0xfe74 },
+    { 0xfe76, 0xfefc }, { 0xff21, 0xff3a }, { 0xff41, 0xff5a }, { 0xff66, 0xffbe }, { 0xffc2, 0xffc7 },
+    { 0xffca, 0xffcf }, { 0xffd2, 0xffd7 }, { 0xffda, 0xffdc }, { 0x10000, 0x1000b }, { 0x1000d, 0x10026 },
+    { 0x10028, 0x1003a }, { 0x1003c, 0x1003d }, { 0x1003f, 0x1004d }, { 0x10050, 0x1005d }, { 0x10080, 0x100fa },
+    { 0x10280, 0x1029c }, { 0x102a0, 0x102d0 }, { 0x10300, 0x1031f }, { 0x1032d, 0x10340 }, { 0x10342, 0x10349 },
+    { 0x10350, 0x10375 }, { 0x10380, 0x1039d }, { 0x103a0, 0x103c3 }, { 0x103c8, 0x103cf }, { 0x10400, 0x1049d },
+    { 0x104b0, 0x104d3 }, { 0x104d8, 0x104fb }, { 0x10500, 0x10527 }, { 0x10530, 0x10563 }, { 0x10570, 0x1057a },
+    { 0x1057c, 0x1058a }, { 0x1058c, 0x10592 }, { 0x10594, 0x10595 }, { 0x10597, 0x105a1 }, { 0x105a3, 0x105b1 },
+    { 0x105b3, 0x105b9 }, { 0x105bb, 0x105bc }, { 0x105c0, 0x105f3 }, { 0x10600, 0x10736 }, { 0x10740, 0x10755 },
+    { 0x10760, 0x10767 }, { 0x10780, 0x10785 }, { 0x10787, 0x107b0 }, { 0x107b2, 0x107bf }, { 0x10800, 0x10805 },
+    { 0x10808, 0x10808 }, { 0x1080a, 0x10835 }, { 0x10837, 0x10838 }, { 0x1083c, 0x1083c }, { 0x1083f, 0x10855 },
+    { 0x10860, 0x10876 }, { 0x10880, 0x1089e }, { 0x108e0, 0x108f2 }, { 0x108f4, 0x108f5 }, { 0x10900, 0x10915 },
+    { 0x10920, 0x10939 }, { 0x10940, 0x10959 }, { 0x10980, 0x109b7 }, { 0x109be, 0x109bf }, { 0x10a00, 0x10a00 },
+    { 0x10a10, 0x10a13 }, { 0x10a15, 0x10a17 }, { 0x10a19, 0x10a35 }, { 0x10a60, 0x10a7c }, { 0x10a80, 0x10a9c },
+    { 0x10ac0, 0x10ac7 }, { 0x10ac9, 0x10ae4 }, { 0x10b00, 0x10b35 }, { 0x10b40, 0x10b55 }, { 0x10b60, 0x10b72 },
+    { 0x10b80, 0x10b91 }, { 0x10c00, 0x10c48 }, { 0x10c80, 0x10cb2 }, { 0x10cc0, 0x10cf2 }, { 0x10d00, 0x10d23 },
+    { 0x10d4a, 0x10d65 }, { 0x10d6f, 0x10d85 }, { 0x10e80, 0x10ea9 }, { 0x10eb0, 0x10eb1 }, { 0x10ec2, 0x10ec7 },
+    { 0x10ed9, 0x10eee }, { 0x10f00, 0x10f1c }, { 0x10f27, 0x10f27 }, { 0x10f30, 0x10f45 }, { 0x10f70, 0x10f81 },
+    { 0x10fb0, 0x10fc4 }, { 0x10fe0, 0x10ff6 }, { 0x11003, 0x11037 }, { 0x11071, 0x11072 }, { 0x11075, 0x11075 },
+    { 0x11083, 0x110af }, { 0x110d0, 0x110e8 }, { 0x11103, 0x11126 }, { 0x11144, 0x11144 }, { 0x11147, 0x11147 },
+    { 0x11150, 0x11172 }, { 0x11176, 0x11176 }, { 0x11183, 0x111b2 }, { 0x111c1, 0x111c4 }, { 0x111da, 0x111da },
+    { 0x111dc, 0x111dc }, { 0x11200, 0x11211 }, { 0x11213, 0x1122b }, { 0x1123f, 0x11240 }, { 0x11280, 0x11286 },
+    { 0x11288, 0x11288 }, { 0x1128a, 0x1128d }, { 0x1128f, 0x1129d }, { 0x1129f, 0x112a8 }, { 0x112b0, 0x112de },
+    { 0x11305, 0x1130c }, { 0x1130f, 0x11310 }, { 0x11313, 0x11328 }, { 0x1132a, 0x11330 }, { 0x11332, 0x11333 },
+    { 0x11335, 0x11339 }, { 0x1133d, 0x1133d }, { 0x11350, 0x11350 }, { 0x1135d, 0x11361 }, { 0x11380, 0x11389 },
+    { 0x1138b, 0x1138b }, { 0x1138e, 0x1138e }, { 0x11390, 0x113b5 }, { 0x113b7, 0x113b7 }, { 0x113d1, 0x113d1 },
+    { 0x113d3, 0x113d3 }, { 0x11400, 0x11434 }, { 0x11447, 0x1144a }, { 0x1145f, 0x11461 }, { 0x11480, 0x114af },
+    { 0x114c4, 0x114c5 }, { 0x114c7, 0x114c7 }, { 0x11580, 0x115ae }, { 0x115d8, 0x115db }, { 0x11600, 0x1162f },
+    { 0x11644, 0x11644 }, { 0x11680, 0x116aa }, { 0x116b8, 0x116b8 }, { 0x11700, 0x1171a }, { 0x11740, 0x11746 },
+    { 0x11800, 0x1182b }, { 0x118a0, 0x118df }, { 0x118ff, 0x11906 }, { 0x11909, 0x11909 }, { 0x1190c, 0x11913 },
+    { 0x11915, 0x11916 }, { 0x11918, 0x1192f }, { 0x1193f, 0x1193f }, { 0x11941, 0x11941 }, { 0x119a0, 0x119a7 },
+    { 0x119aa, 0x119d0 }, { 0x119e1, 0x119e1 }, { 0x119e3, 0x119e3 }, { 0x11a00, 0x11a00 }, { 0x11a0b, 0x11a32 },
+    { 0x11a3a, 0x11a3a }, { 0x11a50, 0x11a50 }, { 0x11a5c, 0x11a89 }, { 0x11a9d, 0x11a9d }, { 0x11ab0, 0x11af8 },
+    { 0x11b0a, 0x11b0a }, { 0x11bc0, 0x11be0 }, { 0x11c00, 0x11c08 }, { 0x11c0a, 0x11c2e }, { 0x11c40, 0x11c40 },
+    { 0x11c72, 0x11c8f }, { 0x11d00, 0x11d06 }, { 0x11d08, 0x11d09 }, { 0x11d0b, 0x11d30 }, { 0x11d46, 0x11d46 },
+    { 0x11d60, 0x11d65 }, { 0x11d67, 0x11d68 }, { 0x11d6a, 0x11d89 }, { 0x11d98, 0x11d98 }, { 0x11db0, 0x11ddb },
+    { 0x11df1, 0x11df1 }, { 0x11ee0, 0x11ef2 }, { 0x11f02, 0x11f02 }, { 0x11f04, 0x11f10 }, { 0x11f12, 0x11f33 },
+    { 0x11fb0, 0x11fb0 }, { 0x12000, 0x12399 }, { 0x12480, 0x12543 }, { 0x12f90, 0x12ff0 }, { 0x13000, 0x1342f },
+    { 0x13441, 0x13446 }, { 0x13460, 0x143fa }, { 0x14400, 0x14646 }, { 0x16100, 0x1611d }, { 0x16800, 0x16a38 },
+    { 0x16a40, 0x16a5e }, { 0x16a70, 0x16abe }, { 0x16ad0, 0x16aed }, { 0x16b00, 0x16b2f }, { 0x16b40, 0x16b43 },
+    { 0x16b63, 0x16b77 }, { 0x16b7d, 0x16b8f }, { 0x16d40, 0x16d6c }, { 0x16e40, 0x16e7f }, { 0x16ea0, 0x16eb8 },
+    { 0x16ebb, 0x16ed3 }, { 0x16f00, 0x16f4a }, { 0x16f50, 0x16f50 }, { 0x16f93, 0x16f9f }, { 0x16fe0, 0x16fe1 },
+    { 0x16fe3, 0x16fe3 }, { 0x16ff2, 0x16ff3 }, { 0x17000, 0x18cda }, { 0x18cff, 0x18d20 }, { 0x18d80, 0x18df2 },
+    { 0x18e00, 0x19191 }, { 0x191a0, 0x191d2 }, { 0x1aff0, 0x1aff3 }, { 0x1aff5, 0x1affb }, { 0x1affd, 0x1affe },
+    { 0x1b000, 0x1b128 }, { 0x1b132, 0x1b132 }, { 0x1b150, 0x1b152 }, { 0x1b155, 0x1b155 }, { 0x1b164, 0x1b168 },
+    { 0x1b170, 0x1b2fb }, { 0x1bc00, 0x1bc6a }, { 0x1bc70, 0x1bc7c }, { 0x1bc80, 0x1bc88 }, { 0x1bc90, 0x1bc99 },
+    { 0x1d400, 0x1d454 }, { 0x1d456, 0x1d49c }, { 0x1d49e, 0x1d49f }, { 0x1d4a2, 0x1d4a2 }, { 0x1d4a5, 0x1d4a6 },
+    { 0x1d4a9, 0x1d4ac }, { 0x1d4ae, 0x1d4b9 }, { 0x1d4bb, 0x1d4bb }, { 0x1d4bd, 0x1d4c3 }, { 0x1d4c5, 0x1d505 },
+    { 0x1d507, 0x1d50a }, { 0x1d50d, 0x1d514 }, { 0x1d516, 0x1d51c }, { 0x1d51e, 0x1d539 }, { 0x1d53b, 0x1d53e },
+    { 0x1d540, 0x1d544 }, { 0x1d546, 0x1d546 }, { 0x1d54a, 0x1d550 }, { 0x1d552, 0x1d6a6 }, { 0x1d6a8, 0x1d6c0 },
+    { 0x1d6c2, 0x1d6da }, { 0x1d6dc, 0x1d6fa }, { 0x1d6fc, 0x1d714 }, { 0x1d716, 0x1d734 }, { 0x1d736, 0x1d74e },
+    { 0x1d750, 0x1d76e }, { 0x1d770, 0x1d788 }, { 0x1d78a, 0x1d7a8 }, { 0x1d7aa, 0x1d7c2 }, { 0x1d7c4, 0x1d7cb },
+    { 0x1df00, 0x1df81 }, { 0x1df90, 0x1df96 }, { 0x1dfcd, 0x1dfff }, { 0x1e030, 0x1e06d }, { 0x1e100, 0x1e12c },
+    { 0x1e137, 0x1e13d }, { 0x1e14e, 0x1e14e }, { 0x1e290, 0x1e2ad }, { 0x1e2c0, 0x1e2eb }, { 0x1e4d0, 0x1e4eb },
+    { 0x1e5d0, 0x1e5ed }, { 0x1e5f0, 0x1e5f0 }, { 0x1e6c0, 0x1e6de }, { 0x1e6e0, 0x1e6e2 }, { 0x1e6e4, 0x1e6e5 },
+    { 0x1e6e7, 0x1e6ed }, { 0x1e6f0, 0x1e6f4 }, { 0x1e6fe, 0x1e6ff }, { 0x1e7e0, 0x1e7e6 }, { 0x1e7e8, 0x1e7eb },
+    { 0x1e7ed, 0x1e7ee }, { 0x1e7f0, 0x1e7fe }, { 0x1e800, 0x1e8c4 }, { 0x1e900, 0x1e943 }, { 0x1e94b, 0x1e94b },
+    { 0x1ee00, 0x1ee03 }, { 0x1ee05, 0x1ee1f }, { 0x1ee21, 0x1ee22 }, { 0x1ee24, 0x1ee24 }, { 0x1ee27, 0x1ee27 },
+    { 0x1ee29, 0x1ee32 }, { 0x1ee34, 0x1ee37 }, { 0x1ee39, 0x1ee39 }, { 0x1ee3b, 0x1ee3b }, { 0x1ee42, 0x1ee42 },
+    { 0x1ee47, 0x1ee47 }, { 0x1ee49, 0x1ee49 }, { 0x1ee4b, 0x1ee4b }, { 0x1ee4d, 0x1ee4f }, { 0x1ee51, 0x1ee52 },
+    { 0x1ee54, 0x1ee54 }, { 0x1ee57, 0x1ee57 }, { 0x1ee59, 0x1ee59 }, { 0x1ee5b, 0x1ee5b }, { 0x1ee5d, 0x1ee5d },
+    { 0x1ee5f, 0x1ee5f }, { 0x1ee61, 0x1ee62 }, { 0x1ee64, 0x1ee64 }, { 0x1ee67, 0x1ee6a }, { 0x1ee6c, 0x1ee72 },
+    { 0x1ee74, 0x1ee77 }, { 0x1ee79, 0x1ee7c }, { 0x1ee7e, 0x1ee7e }, { 0x1ee80, 0x1ee89 }, { 0x1ee8b, 0x1ee9b },
+    { 0x1eea1, 0x1eea3 }, { 0x1eea5, 0x1eea9 }, { 0x1eeab, 0x1eebb }, { 0x20000, 0x2a6df }, { 0x2a700, 0x2b81e },
+    { 0x2b820, 0x2cead }, { 0x2ceb0, 0x2ebe0 }, { 0x2ebf0, 0x2ee5d }, { 0x2f800, 0x2fa1d }, { 0x30000, 0x3134a },
+    { 0x31350, 0x33479 }, { 0x3d000, 0x3fc3f }
+};
+
+static const uint32_t number_ranges[][2] = {
+    { 0x30, 0x39 }, { 0xb2, 0xb3 }, { 0xb9, 0xb9 }, { 0xbc, 0xbe }, { 0x660, 0x669 }, { 0x6f0, 0x6f9 },
+    { 0x7c0, 0x7c9 }, { 0x966, 0x96f }, { 0x9e6, 0x9ef }, { 0x9f4, 0x9f9 }, { 0xa66, 0xa6f }, { 0xae6, 0xaef },
+    { 0xb66, 0xb6f }, { 0xb72, 0xb77 }, { 0xbe6, 0xbf2 }, { 0xc66, 0xc6f }, { 0xc78, 0xc7e }, { 0xce6, 0xcef },
+    { 0xd58, 0xd5e }, { 0xd66, 0xd78 }, { 0xde6, 0xdef }, { 0xe50, 0xe59 }, { 0xed0, 0xed9 }, { 0xf20, 0xf33 },
+    { 0x1040, 0x1049 }, { 0x1090, 0x1099 }, { 0x1369, 0x137c }, { 0x16ee, 0x16f0 }, { 0x17e0, 0x17e9 },
+    { 0x17f0, 0x17f9 }, { 0x1810, 0x1819 }, { 0x1946, 0x194f }, { 0x19d0, 0x19da }, { 0x1a80, 0x1a89 },
+    { 0x1a90, 0x1a99 }, { 0x1b50, 0x1b59 }, { 0x1bb0, 0x1bb9 }, { 0x1c40, 0x1c49 }, { 0x1c50, 0x1c59 },
+    { 0x2070, 0x2070 }, { 0x2074, 0x2079 }, { 0x2080, 0x2089 }, { 0x2150, 0x2182 }, { 0x2185, 0x2189 },
+    { 0x2460, 0x249b }, { 0x24ea, 0x24ff }, { 0x2776, 0x2793 }, { 0x2cfd, 0x2cfd }, { 0x3007, 0x3007 },
+    { 0x3021, 0x3029 }, { 0x3038, 0x303a }, { 0x3192, 0x3195 }, { 0x3220, 0x3229 }, { 0x3248, 0x324f },
+    { 0x3251, 0x325f }, { 0x3280, 0x3289 }, { 0x32b1, 0x32bf }, { 0xa620, 0xa629 }, { 0xa6e6, 0xa6ef },
+    { 0xa830, 0xa835 }, { 0xa8d0, 0xa8d9 }, { 0xa900, 0xa909 }, { 0xa9d0, 0xa9d9 }, { 0xa9f0, 0xa9f9 },
+    { 0xaa50, 0xaa59 }, { 0xabf0, 0xabf9 }, { 0xff10, 0xff19 }, { 0x10107, 0x10133 }, { 0x10140, 0x10178 },
+    { 0x1018a, 0x1018b }, { 0x102e1, 0x102fb }, { 0x10320, 0x10323 }, { 0x10341, 0x10341 }, { 0x1034a, 0x1034a },
+    { 0x103d1, 0x103d5 }, { 0x104a0, 0x104a9 }, { 0x10858, 0x1085f }, { 0x10879, 0x1087f }, { 0x108a7, 0x108af },
+    { 0x108fb, 0x108ff }, { 0x10916, 0x1091b }, { 0x109bc, 0x109bd }, { 0x109c0, 0x109cf }, { 0x109d2, 0x109ff },
+    { 0x10a40, 0x10a48 }, { 0x10a7d, 0x10a7e }, { 0x10a9d, 0x10a9f }, { 0x10aeb, 0x10aef }, { 0x10b58, 0x10b5f },
+    { 0x10b78, 0x10b7f }, { 0x10ba9, 0x10baf }, { 0x10cfa, 0x10cff }, { 0x10d30, 0x10d39 }, { 0x10d40, 0x10d49 },
+    { 0x10e60, 0x10e7e }, { 0x10f1d, 0x10f26 }, { 0x10f51, 0x10f54 }, { 0x10fc5, 0x10fcb }, { 0x11052, 0x1106f },
+    { 0x110f0, 0x110f9 }, { 0x11136, 0x1113f }, { 0x111d0, 0x111d9 }, { 0x111e1, 0x111f4 }, { 0x112f0, 0x112f9 },
+    { 0x11450, 0x11459 }, { 0x114d0, 0x114d9 }, { 0x11650, 0x11659 }, { 0x116c0, 0x116c9 }, { 0x116d0, 0x116e3 },
+    { 0x11730, 0x1173b }, { 0x118e0, 0x118f2 }, { 0x11950, 0x11959 }, { 0x11bf0, 0x11bf9 }, { 0x11c50, 0x11c6c },
+    { 0x11d50, 0x11d59 }, { 0x11da0, 0x11da9 }, { 0x11de0, 0x11de9 }, { 0x11f50, 0x11f59 }, { 0x11fc0, 0x11fd4 },
+    { 0x12400, 0x1246f }, { 0x12475, 0x1247f }, { 0x12550, 0x12686 }, { 0x16130, 0x16139 }, { 0x16a60, 0x16a69 },
+    { 0x16ac0, 0x16ac9 }, { 0x16b50, 0x16b59 }, { 0x16b5b, 0x16b61 }, { 0x16d70, 0x16d79 }, { 0x16e80, 0x16e96 },
+    { 0x16ff4, 0x16ff6 }, { 0x1ccf0, 0x1ccf9 }, { 0x1d2c0, 0x1d2d3 }, { 0x1d2e0, 0x1d2f3 }, { 0x1d360, 0x1d378 },
+    { 0x1d7ce, 0x1d7ff }, { 0x1e140, 0x1e149 }, { 0x1e2f0, 0x1e2f9 }, { 0x1e4f0, 0x1e4f9 }, { 0x1e5f1, 0x1e5fa },
+    { 0x1e8c7, 0x1e8cf }, { 0x1e950, 0x1e959 }, { 0x1ec71, 0x1ecab }, { 0x1ecad, 0x1ecaf }, { 0x1ecb1, 0x1ecb4 },
+    { 0x1ed01, 0x1ed2d }, { 0x1ed2f, 0x1ed3d }, { 0x1f100, 0x1f10c }, { 0x1fbf0, 0x1fbf9 }
+};
+
+static const uint32_t space_ranges[][2] = {
+    { 0x9, 0xd }, { 0x20, 0x20 }, { 0x85, 0x85 }, { 0xa0, 0xa0 }, { 0x1680, 0x1680 }, { 0x2000, 0x200a },
+    { 0x2028, 0x2029 }, { 0x202f, 0x202f }, { 0x205f, 0x205f }, { 0x3000, 0x3000 }
+};
+
+static int in_ranges(const uint32_t (*ranges)[2], size_t num_ranges, uint32_t cp) {
+    size_t lo = 0, hi = num_ranges;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (cp > ranges[mid][1]) {
+            lo = mid + 1;
+        } else if (cp < ranges[mid][0]) {
+            hi = mid;
+        } else {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int char_class(uint32_t cp) {
+    if (in_ranges(letter_ranges, sizeof(letter_ranges) / sizeof(letter_ranges[0]), cp)) {
+        return CHAR_LETTER;
+    }
+    if (in_ranges(number_ranges, sizeof(number_ranges) / sizeof(number_ranges[0]), cp)) {
+        return CHAR_NUMBER;
+    }
+    if (in_ranges(space_ranges, sizeof(space_ranges) / sizeof(space_ranges[0]), cp)) {
+        return CHAR_SPACE;
+    }
+    return CHAR_OTHER;
+}
+
+// Class and length of the character at bytes[i]. A byte that does not start
+// a valid UTF-8 character is a character of its own, of class CHAR_OTHER.
+static int char_at(const unsigned char *bytes, size_t length, size_t i, size_t *size) {
+    if (i >= length) {
+        *size = 0;
+        return CHAR_END;
+    }
+    uint32_t cp;
+    *size = utf8_decode(bytes + i, length - i, &cp);
+    if (*size == 0) {
+        *size = 1;
+        return CHAR_OTHER;
+    }
+    return char_class(cp);
+}
+
+// End of the run of characters of class `cls` starting at bytes[i].
+static size_t class_run(const unsigned char *bytes, size_t length, size_t i, int cls) {
+    size_t size;
+    while (char_at(bytes, length, i, &size) == cls) {
+        i += size;
+    }
+    return i;
+}
+
+// Length of a contraction ('s, 'd, 'm, 't, 'll, 've, 're) at the start of `bytes`, or 0.
+static size_t contraction_length(const unsigned char *bytes, size_t length, int ignore_case) {
+    if (length < 2 || bytes[0] != '\'') {
+        return 0;
+    }
+    unsigned char a = bytes[1];
+    unsigned char b = length > 2 ? bytes[2] : 0;
+    if (ignore_case) {
+        // Beyond ASCII, only U+017F LONG S case-folds to one of these letters.
+        if (a == 0xc5 && b == 0xbf) {
+            return 3;
+        }
+        a = a >= 'A' && a <= 'Z' ? a + 32 : a;
+        b = b >= 'A' && b <= 'Z' ? b + 32 : b;
+    }
+    if (a == 's' || a == 'd' || a == 'm' || a == 't') {
+        return 2;
+    }
+    if ((a == 'l' && b == 'l') || (a == 'v' && b == 'e') || (a == 'r' && b == 'e')) {
+        return 3;
+    }
+    return 0;
+}
+
+// Length of a whitespace chunk at the start of `bytes`: `\s+(?!\S)|\s+`.
+static size_t whitespace_chunk(const unsigned char *bytes, size_t length) {
+    size_t i = 0, last = 0, size;
+    while (char_at(bytes, length, i, &size) == CHAR_SPACE) {
+        last = i;
+        i += size;
+    }
+    // Leave the last space for the word that follows, unless it is the only one.
+    return i < length && last > 0 ? last : i;
+}
+
+/*
+* @brief Length of the chunk the GPT-2 split pattern matches at the start of `bytes`.
+*
+* Hand-written equivalent of GPT2_SPLIT_PATTERN:
+* '(?:[sdmt]|ll|ve|re)| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
+*/
+static size_t gpt2_chunk(const unsigned char *bytes, size_t length) {
+    size_t contraction = contraction_length(bytes, length, 0);
+    if (contraction) {
+        return contraction;
+    }
+    size_t start = 0, size;
+    int cls = char_at(bytes, length, 0, &size);
+    if (bytes[0] == ' ') {
+        int next = char_at(bytes, length, 1, &size);
+        if (next == CHAR_LETTER || next == CHAR_NUMBER || next == CHAR_OTHER) {
+            start = 1;
+            cls = next;
+        }
+    }
+    if (cls != CHAR_SPACE) {
+        return class_run(bytes, length, start, cls);
+    }
+    return whitespace_chunk(bytes, length);
+}
+
+/*
+* @brief Length of the chunk the GPT-4 (cl100k) split pattern matches at the start of `bytes`.
+*
+* Hand-written equivalent of GPT4_SPLIT_PATTERN:
+* '(?i:[sdmt]|ll|ve|re)|[^\r\n\p{L}\p{N}]?+\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]++[\r\n]*|\s*[\r\n]|\s+(?!\S)|\s+
+*/
+static size_t gpt4_chunk(const unsigned char *bytes, size_t length) {
+    size_t contraction = contraction_length(bytes, length, 1);
+    if (contraction) {
+        return contraction;
+    }
+    size_t size, next_size;
+    int cls = char_at(bytes, length, 0, &size);
+    if (cls == CHAR_LETTER) {
+        return class_run(bytes, length, 0, CHAR_LETTER);
+    }
+    // One optional leading character that is not a newline, letter or number.
+    if (cls != CHAR_NUMBER && bytes[0] != '\r' && bytes[0] != '\n' &&
+        char_at(bytes, length, size, &next_size) == CHAR_LETTER) {
+        return class_run(bytes, length, size, CHAR_LETTER);
+    }
+    if (cls == CHAR_NUMBER) {
+        size_t i = 0;
+        for (int digits = 0; digits < 3 && char_at(bytes, length, i, &size) == CHAR_NUMBER; ++digits) {
+            i += size;
+        }
+        return i;
+    }
+    size_t start = bytes[0] == ' ' && char_at(bytes, length, 1, &size) == CHAR_OTHER ? 1 : 0;
+    if (char_at(bytes, length, start, &size) == CHAR_OTHER) {
+        size_t i = class_run(bytes, length, start, CHAR_OTHER);
+        while (i < length && (bytes[i] == '\r' || bytes[i] == '\n')) {
+            i++;
+        }
+        return i;
+    }
+    // Whitespace: up to and including the last newline of the run, if it has one.
+    size_t end = class_run(bytes, length, 0, CHAR_SPACE);
+    for (size_t i = end; i > 0; --i) {
+        if (bytes[i - 1] == '\r' || bytes[i - 1] == '\n') {
+            return i;
+        }
+    }
+    return whitespace_chunk(bytes, length);
+}
+
+/*
+* @brief Length of the next pre-tokenization chunk at the start of `data`.
+*
+* @param pattern The split pattern.
+* @param data The text; must not be empty.
+* @param size Number of bytes in data.
+* @return The chunk length, at least 1; all of `size` for SPLIT_NONE.
+*/
+static size_t split_chunk(SplitPattern pattern, const unsigned char *data, size_t size) {
+    switch (pattern) {
+    case SPLIT_GPT2:
+        return gpt2_chunk(data, size);
+    case SPLIT_GPT4:
+        return gpt4_chunk(data, size);
+    default:
+        return size;
+    }
+}
+
+/*
+* @brief Trains on the distinct chunks of a ChunkTable, each weighted by its count.
+*
+* The chunks are laid out in first-seen order, so the leftmost occurrence of a
+* pair is also its first occurrence in the text and ties break as in train().
+*
+* @return 0 on success, -1 if allocation fails.
+*/
+static int train_chunks(BasicTokenizer *tokenizer, const ChunkTable *table, size_t vocab_size, int verbose) {
+    const char **segments = (const char**)mem_alloc(tokenizer->allocator, (table->size + 1) * sizeof(char*));
+    if (!segments) {
+        return -1;
+    }
+    for (size_t i = 0; i < table->size; ++i) {
+        segments[i] = (const char*)table->bytes + table->offsets[i];
+    }
+
+    TrainState state;
+    int status = train_state_init(&state, segments, table->lengths, table->counts, table->size, tokenizer->allocator);
+    mem_free(tokenizer->allocator, segments);
+    if (status != 0) {
+        return -1;
+    }
+    status = train_from_state(tokenizer, &state, vocab_size, verbose);
+    train_state_free(&state);
+    return status;
+}
+
+/*
+* @brief Adds every chunk of `data` to `chunks`, split by the tokenizer's pattern or, without one, into words.
+*
+* @return 0 on success, -1 if allocation fails.
+*/
+static int count_chunks(const BasicTokenizer *tokenizer, const char *data, size_t size, ChunkTable *chunks) {
+    const unsigned char *bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; ) {
+        size_t length = tokenizer->split_pattern != SPLIT_NONE
+                      ? split_chunk(tokenizer->split_pattern, bytes + i, size - i)
+                      : word_length(bytes + i, size - i);
+        if (chunk_table_add(chunks, bytes + i, length, 1) != 0) {
+            return -1;
+        }
+        i += length;
+    }
+    return 0;
+}
+
+/*
+* @brief Trains the tokenizer on the distinct words of the text, weighted by frequency.
+*
+* The text is split into words by the tokenizer's split pattern, or by
+* whitespace (see word_length()) if it has none, and the words are
+* deduplicated into a table of (word, count). BPE then runs once over the
+* unique words, with every pair counted as many times as its word occurs, so
+* on natural language the working set is the vocabulary of the text rather
+* than its length. Merges never span two words. Ties go to the pair that
+* occurs first in the text, so with a split pattern the merges are the same as
+* those of minbpe's RegexTokenizer.
+*
+* @param tokenizer Pointer to the BasicTokenizer to be trained.
+* @param data The bytes to train on; may contain NULs.
+* @param size Number of bytes in data.
+* @param vocab_size The desired final vocabulary size.
+* @param verbose If non-zero, print progress information during training.
+* @return 0 on success; -1 if the tokenizer cannot be trained (see check_trainable()), or if
+*         allocation fails, in which case the merges learned until then are kept.
+*/
+int train_words(BasicTokenizer *tokenizer, const char *data, size_t size, size_t vocab_size, int verbose) {
+    ChunkTable words;
+    if (chunk_table_init(&words, 1024, tokenizer->allocator) != 0) {
+        return -1;
+    }
+    if (count_chunks(tokenizer, data, size, &words) != 0) {
+        chunk_table_free(&words);
+        return -1;
+    }
+
+    if (verbose) {
+        printf("Training on %zu distinct words from %zu bytes\n", words.size, size);
+    }
+    int status = train_chunks(tokenizer, &words, vocab_size, verbose);
+    chunk_table_free(&words);
+    return status;
+}
+
+/*
+* @brief Maps a whole file read-only.
+*
+* @return 0 on success, -1 if the file cannot be opened or mapped. Empty files map to NULL.
+*/
+static int map_file(const char *path, void **data, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    *size = (size_t)st.st_size;
+    *data = NULL;
+    if (*size > 0) {
+        *data = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (*data == MAP_FAILED) {
+        *data = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const*)a, *(char *const*)b);
+}
+
+/*
+* @brief Appends `path` to the list, or every regular file in it, sorted by name, if it is a directory.
+*
+* @return 0 on success, -1 if the path cannot be read or allocation fails.
+*/
+static int collect_corpus_files(const char *path, char ***files, size_t *num_files, size_t *capacity,
+                                const Allocator *allocator) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        if (*num_files == *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 64;
+            char **grown = (char**)mem_realloc(allocator, *files, *capacity * sizeof(char*));
+            if (!grown) {
+                return -1;
+            }
+            *files = grown;
+        }
+        size_t path_size = strlen(path) + 1;
+        char *copy = (char*)mem_alloc(allocator, path_size);
+        if (!copy) {
+            return -1;
+        }
+        memcpy(copy, path, path_size);
+        (*files)[(*num_files)++] = copy;
+        return 0;
+    }
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return -1;
+    }
+    size_t first = *num_files;
+    size_t path_size = strlen(path);
+    int status = 0;
+    struct dirent *entry;
+    while (status == 0 && (entry = readdir(dir)) != NULL) {
+        char *child = (char*)mem_alloc(allocator, path_size + strlen(entry->d_name) + 2);
+        if (!child) {
+            status = -1;
+            break;
+        }
+        sprintf(child, "%s/%s", path, entry->d_name);
+        if (stat(child, &st) == 0 && S_ISREG(st.st_mode)) {
+            status = collect_corpus_files(child, files, num_files, capacity, allocator);
+        }
+        mem_free(allocator, child);
+    }
+    closedir(dir);
+    // readdir() order depends on the file system; sort for a reproducible corpus order.
+    qsort(*files + first, *num_files - first, sizeof(char*), compare_strings);
+    return status;
+}
+
+/*
+* @brief Trains the tokenizer on a corpus of files, each mapped rather than read into memory.
+*
+* Each path is a file or a directory whose regular files are all used (not
+* recursively), in name order. The files are memory-mapped rather than read,
+* and unmapped before merging starts. Files are trained as separate
+* documents: no merge spans two files.
+*
+* Without a split pattern the files are copied into one array of ids, with a
+* -1 between files, and trained as in train_parallel(): 4 bytes of memory per
+* corpus byte plus the pair counts, and a full pass over the ids per merge.
+* With a split pattern set, the files' chunks are deduplicated as in
+* train_words() and memory grows with the number of distinct chunks instead,
+* which for natural text is a small fraction of the corpus.
+*
+* @param tokenizer Pointer to the BasicTokenizer to be trained.
+* @param paths Array of file or directory paths.
+* @param num_paths Number of paths.
+* @param vocab_size The desired final vocabulary size.
+* @param verbose If non-zero, print progress information during training.
+* @return 0 on success, -1 if the tokenizer cannot be trained (see check_trainable()), a path
+*         cannot be read or allocation fails.
+*/
+int train_files(BasicTokenizer *tokenizer, const char *const *paths, size_t num_paths, size_t vocab_size, int verbose) {
+    const Allocator *allocator = tokenizer->allocator;
+    char **files = NULL;
+    size_t num_files = 0, capacity = 0;
+    int status = check_trainable(tokenizer, vocab_size);
+    for (size_t i = 0; i < num_paths && status == 0; ++i) {
+        status = collect_corpus_files(paths[i], &files, &num_files, &capacity, allocator);
+    }
+
+    void **data = (void**)mem_calloc(allocator, num_files + 1, sizeof(void*));
+    size_t *sizes = (size_t*)mem_calloc(allocator, num_files + 1, sizeof(size_t));
+    if (!data || !sizes) {
+        status = -1;
+    }
+    for (size_t i = 0; i < num_files && status == 0; ++i) {
+        status = map_file(files[i], &data[i], &sizes[i]);
+        if (status == 0 && verbose) {
+            printf("Mapped %s (%zu bytes)\n", files[i], sizes[i]);
+        }
+    }
+
+    ChunkTable chunks;
+    memset(&chunks, 0, sizeof(ChunkTable));
+    int *ids = NULL;
+    size_t ids_size = 0;
+    int split = tokenizer->split_pattern != SPLIT_NONE;
+    if (status == 0 && split) {
+        status = chunk_table_init(&chunks, 1024, allocator);
+        for (size_t i = 0; i < num_files && status == 0; ++i) {
+            status = count_chunks(tokenizer, (const char*)data[i], sizes[i], &chunks);
+        }
+    } else if (status == 0) {
+        size_t total = num_files > 0 ? num_files - 1 : 0;
+        for (size_t i = 0; i < num_files; ++i) {
+            total += sizes[i];
+        }
+        ids = (int*)mem_alloc(allocator, total * sizeof(int));
+        if (total && !ids) {
+            status = -1;
+        }
+        for (size_t i = 0; i < num_files && status == 0; ++i) {
+            if (i > 0) {
+                ids[ids_size++] = -1;
+            }
+            const unsigned char *bytes = (const unsigned char*)data[i];
+            for (size_t j = 0; j < sizes[i]; ++j) {
+                ids[ids_size++] = bytes[j];
+            }
+            // Unmap as soon as the file is copied so the copy and the mappings do not peak together.
+            if (data[i]) {
+                munmap(data[i], sizes[i]);
+                data[i] = NULL;
+            }
+        }
+    }
+    for (size_t i = 0; i < num_files; ++i) {
+        if (data && data[i]) {
+            munmap(data[i], sizes[i]);
+        }
+        mem_free(allocator, files[i]);
+    }
+    mem_free(allocator, files);
+    mem_free(allocator, data);
+    mem_free(allocator, sizes);
+
+    if (status == 0 && split) {
+        status = train_chunks(tokenizer, &chunks, vocab_size, verbose);
+    } else if (status == 0) {
+        status = train_ids(tokenizer, ids, ids_size, vocab_size, NULL, verbose);
+    }
+    mem_free(allocator, ids);
+    chunk_table_free(&chunks);
+    return status;
+}
+
+static void encode_workspace_init(EncodeWorkspace *workspace, const Allocator *allocator) {
+    memset(workspace, 0, sizeof(EncodeWorkspace));
+    workspace->cache_limit = ENCODE_CACHE_SIZE;
+    workspace->allocator = allocator;
+    workspace->queue.allocator = allocator;
+}
+
+static void encode_cache_free(EncodeWorkspace *workspace) {
+    mem_free(workspace->allocator, workspace->cache);
+    mem_free(workspace->allocator, workspace->cache_slots);
+    workspace->cache = NULL;
+    workspace->cache_slots = NULL;
+    workspace->cache_size = 0;
+    workspace->cache_hand = 0;
+    workspace->cache_allocated = 0;
+    workspace->cache_capacity = 0;
+    workspace->cache_generation = 0;
+}
+
+static void encode_workspace_free(EncodeWorkspace *workspace) {
+    mem_free(workspace->allocator, workspace->prev);
+    mem_free(workspace->allocator, workspace->next);
+    mem_free(workspace->allocator, workspace->queue.items);
+    encode_cache_free(workspace);
+    memset(workspace, 0, sizeof(EncodeWorkspace));
+}
+
+/*
+* @brief Creates an empty encode workspace.
+*
+* A workspace passed to encode_with_workspace() keeps its buffers and chunk
+* cache between calls, so encoding many texts with one workspace mostly looks
+* up chunks it has seen before. The cache holds ENCODE_CACHE_SIZE chunks
+* unless set_encode_cache_size() changes it.
+*
+* @return A pointer to the new EncodeWorkspace, or NULL if allocation fails.
+*/
+EncodeWorkspace* create_encode_workspace() {
+    return create_encode_workspace_with_allocator(NULL);
+}
+
+/*
+* @brief Creates an empty encode workspace that allocates through `allocator`.
+*
+* @param allocator Memory functions to use, or NULL for the C library; must outlive the workspace.
+* @return A pointer to the new EncodeWorkspace, or NULL if allocation fails.
+*/
+EncodeWorkspace* create_encode_workspace_with_allocator(const Allocator *allocator) {
+    EncodeWorkspace *workspace = (EncodeWorkspace*)mem_alloc(allocator, sizeof(EncodeWorkspace));
+    if (workspace) {
+        encode_workspace_init(workspace, allocator);
+    }
+    return workspace;
+}
+
+/*
+* @brief Frees an EncodeWorkspace and everything it has cached.
+*
+* @param workspace Pointer to the EncodeWorkspace to be cleaned up.
+*/
+void clean_encode_workspace(EncodeWorkspace *workspace) {
+    const Allocator *allocator = workspace->allocator;
+    encode_workspace_free(workspace);
+    mem_free(allocator, workspace);
+}
+
+/*
+* @brief Sets how many chunks a workspace's cache may hold.
+*
+* Drops everything cached and resets the hit and miss counters. Each entry
+* takes sizeof(CacheEntry) bytes plus two index slots. They are allocated as
+* the cache fills, so a workspace that sees few distinct chunks stays small.
+*
+* @param workspace Pointer to the EncodeWorkspace.
+* @param entries Maximum number of cached chunks, or 0 to disable the cache.
+*/
+void set_encode_cache_size(EncodeWorkspace *workspace, size_t entries) {
+    encode_cache_free(workspace);
+    workspace->cache_limit = entries;
+    workspace->cache_hits = 0;
+    workspace->cache_misses = 0;
+}
+
+/*
+* @brief Reports how often a workspace's cache has been consulted.
+*
+* Only chunks longer than one byte consult the cache. A miss is a chunk that
+* had to be merged, including chunks too long to be cached.
+*
+* @param workspace Pointer to the EncodeWorkspace.
+* @param hits Pointer to store the number of chunks found in the cache.
+* @param misses Pointer to store the number of chunks that were merged.
+*/
+void encode_cache_stats(const EncodeWorkspace *workspace, size_t *hits, size_t *misses) {
+    *hits = workspace->cache_hits;
+    *misses = workspace->cache_misses;
+}
+
+static int encode_workspace_reserve(EncodeWorkspace *workspace, size_t text_size) {
+    if (text_size <= workspace->capacity) {
+        return 0;
+    }
+    // Grow geometrically so that a workspace fed ever longer texts reallocates O(log n) times.
+    size_t capacity = workspace->capacity * 2;
+    if (capacity < text_size) {
+        capacity = text_size;
+    }
+    size_t *prev = (size_t*)mem_realloc(workspace->allocator, workspace->prev, capacity * sizeof(size_t));
+    if (prev) {
+        workspace->prev = prev;
+    }
+    size_t *next = (size_t*)mem_realloc(workspace->allocator, workspace->next, capacity * sizeof(size_t));
+    if (next) {
+        workspace->next = next;
+    }
+    if (!prev || !next) {
+        return -1;
+    }
+    workspace->capacity = capacity;
+    return 0;
+}
+
+static int queue_merge(const BasicTokenizer *tokenizer, EncodeWorkspace *workspace, const int *ids, size_t node) {
+    size_t rank = merge_rank(tokenizer, (IntPair){ ids[node], ids[workspace->next[node]] });
+    if (rank == tokenizer->num_merges) {
+        return 0;
+    }
+    return heap_push(&workspace->queue, (HeapItem){ rank, node, 0 });
+}
+
+/*
+* @brief Encodes one chunk of `text_size` bytes using the caller's workspace.
+*
+* The bytes become a linked list of symbols and every adjacent pair with a
+* merge is queued by (rank, position). Popping the queue applies merges in
+* rank order and left to right within a rank, which is exactly the order the
+* repeated "merge the lowest-rank pair everywhere" loop uses, so the output is
+* identical in O(n log n). Entries made stale by an earlier merge are skipped
+* when popped.
+*
+* @return 0 on success, -1 if allocation fails.
+*/
+static int encode_chunk(const BasicTokenizer *tokenizer, const char *text, size_t text_size,
+                        int *ids, size_t *ids_size, EncodeWorkspace *workspace) {
+    *ids_size = text_size;
+    for (size_t i = 0; i < text_size; ++i) {
+        ids[i] = (unsigned char)text[i];
+    }
+    if (text_size < 2 || tokenizer->num_merges == 0) {
+        return 0;
+    }
+    if (encode_workspace_reserve(workspace, text_size) != 0) {
+        return -1;
+    }
+
+    size_t *prev = workspace->prev;
+    size_t *next = workspace->next;
+    workspace->queue.size = 0;
+    for (size_t i = 0; i < text_size; ++i) {
+        prev[i] = i > 0 ? i - 1 : NO_NODE;
+        next[i] = i + 1 < text_size ? i + 1 : NO_NODE;
+    }
+    for (size_t i = 0; i + 1 < text_size; ++i) {
+        if (queue_merge(tokenizer, workspace, ids, i) != 0) {
+            return -1;
+        }
+    }
+
+    while (workspace->queue.size > 0) {
+        HeapItem item = heap_pop(&workspace->queue);
+        size_t i = item.value;
+        size_t j = next[i];
+        const Merge *m = &tokenizer->merges[item.key];
+        if (ids[i] != m->pair.first || j == NO_NODE || ids[j] != m->pair.second) {
+            continue;
+        }
+
+        ids[i] = m->idx;
+        ids[j] = -1;
+        next[i] = next[j];
+        if (next[i] != NO_NODE) {
+            prev[next[i]] = i;
+        }
+
+        if (prev[i] != NO_NODE && queue_merge(tokenizer, workspace, ids, prev[i]) != 0) {
+            return -1;
+        }
+        if (next[i] != NO_NODE && queue_merge(tokenizer, workspace, ids, i) != 0) {
+            return -1;
+        }
+    }
+
+    // The first symbol is never merged away, so the list always starts at 0.
+    size_t n = 0;
+    for (size_t i = 0; i != NO_NODE; i = next[i]) {
+        ids[n++] = ids[i];
+    }
+    *ids_size = n;
+    return 0;
+}
+
+/*
+* @brief Finds the index slot holding a chunk, or the empty slot where it would go.
+*/
+static size_t encode_cache_slot(const EncodeWorkspace *workspace, const unsigned char *chunk, size_t chunk_size,
+                                uint64_t hash) {
+    size_t mask = workspace->cache_capacity - 1;
+    size_t slot = (size_t)hash & mask;
+    while (workspace->cache_slots[slot] != 0) {
+        const CacheEntry *entry = &workspace->cache[workspace->cache_slots[slot] - 1];
+        if (entry->hash == hash && entry->length == chunk_size && memcmp(entry->bytes, chunk, chunk_size) == 0) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/*
+* @brief Doubles the cache's entries, up to its limit, and rebuilds the index to match.
+*
+* @return 0 on success, -1 if allocation fails, leaving the cache as it was.
+*/
+static int encode_cache_grow(EncodeWorkspace *workspace) {
+    size_t entries = workspace->cache_allocated * 2;
+    if (entries > workspace->cache_limit) {
+        entries = workspace->cache_limit;
+    }
+    size_t capacity = workspace->cache_capacity;
+    while (capacity < entries * 2) {
+        capacity *= 2;
+    }
+    CacheEntry *cache = (CacheEntry*)mem_realloc(workspace->allocator, workspace->cache, entries * sizeof(CacheEntry));
+    if (!cache) {
+        return -1;
+    }
+    workspace->cache = cache;
+    size_t *slots = (size_t*)mem_calloc(workspace->allocator, capacity, sizeof(size_t));
+    if (!slots) {
+        return -1;
+    }
+    size_t mask = capacity - 1;
+    for (size_t e = 0; e < workspace->cache_size; ++e) {
+        size_t slot = (size_t)cache[e].hash & mask;
+        while (slots[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        slots[slot] = e + 1;
+    }
+    mem_free(workspace->allocator, workspace->cache_slots);
+    workspace->cache_slots = slots;
+    workspace->cache_capacity = capacity;
+    workspace->cache_allocated = entries;
+    return 0;
+}
+
+/*
+* @brief Picks the entry for a new chunk, evicting one with the CLOCK policy once the cache is full.
+*
+* Until the limit is reached the cache grows instead. Once it is full, the
+* hand skips entries hit since it last passed them, clearing their bit, and
+* takes the first entry that has not been. The victim's index slot is
+* emptied with backward-shift deletion, so lookups never need tombstones.
+*/
+static size_t encode_cache_victim(EncodeWorkspace *workspace) {
+    if (workspace->cache_size < workspace->cache_limit &&
+        (workspace->cache_size < workspace->cache_allocated || encode_cache_grow(workspace) == 0)) {
+        return workspace->cache_size++;
+    }
+    // Full, or growing failed: evict among the entries there are.
+    while (workspace->cache[workspace->cache_hand].referenced) {
+        workspace->cache[workspace->cache_hand].referenced = 0;
+        workspace->cache_hand = (workspace->cache_hand + 1) % workspace->cache_size;
+    }
+    size_t victim = workspace->cache_hand;
+    workspace->cache_hand = (workspace->cache_hand + 1) % workspace->cache_size;
+
+    const CacheEntry *entry = &workspace->cache[victim];
+    size_t *slots = workspace->cache_slots;
+    size_t mask = workspace->cache_capacity - 1;
+    size_t hole = encode_cache_slot(workspace, entry->bytes, entry->length, entry->hash);
+    for (size_t j = (hole + 1) & mask; slots[j] != 0; j = (j + 1) & mask) {
+        size_t home = (size_t)workspace->cache[slots[j] - 1].hash & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            slots[hole] = slots[j];
+            hole = j;
+        }
+    }
+    slots[hole] = 0;
+    return victim;
+}
+
+/*
+* @brief Makes sure the workspace's cache is allocated, empty if it last served another tokenizer.
+*
+* Tokenizers are told apart by generation rather than by address, so a
+* tokenizer freed and replaced at the same address, or one that learned more
+* merges since, never sees ids cached for the old merges.
+*
+* @return 0 on success, -1 if allocation fails.
+*/
+static int encode_cache_reserve(EncodeWorkspace *workspace, const BasicTokenizer *tokenizer) {
+    if (workspace->cache_generation == tokenizer->generation) {
+        return 0;
+    }
+    if (workspace->cache_generation != 0) {
+        workspace->cache_size = 0;
+        workspace->cache_hand = 0;
+        memset(workspace->cache_slots, 0, workspace->cache_capacity * sizeof(size_t));
+        workspace->cache_generation = tokenizer->generation;
+        return 0;
+    }
+    // Start small and keep the index at most half full.
+    size_t entries = workspace->cache_limit < ENCODE_CACHE_INITIAL ? workspace->cache_limit : ENCODE_CACHE_INITIAL;
+    size_t capacity = 1;
+    while (capacity < entries * 2) {
+        capacity *= 2;
+    }
+    workspace->cache = (CacheEntry*)mem_alloc(workspace->allocator, entries * sizeof(CacheEntry));
+    workspace->cache_slots = (size_t*)mem_calloc(workspace->allocator, capacity, sizeof(size_t));
+    if (!workspace->cache || !workspace->cache_slots) {
+        encode_cache_free(workspace);
+        return -1;
+    }
+    workspace->cache_allocated = entries;
+    workspace->cache_capacity = capacity;
+    workspace->cache_generation = tokenizer->generation;
+    return 0;
+}
+
+/*
+* @brief Encodes the chunks that start in the first `size` bytes of a text.
+*
+* Chunk boundaries are decided with all `text_size` bytes in view, since the
+* end of a chunk can depend on what follows it; `size` must be a chunk
+* boundary. Without a split pattern the `size` bytes are a single chunk.
+*
+* @return 0 on success, -1 if allocation fails.
+*/
+static int encode_prefix(const BasicTokenizer *tokenizer, const char *text, size_t size, size_t text_size,
+                         int *ids, size_t *ids_size, EncodeWorkspace *workspace) {
+    *ids_size = 0;
+    if (tokenizer->split_pattern == SPLIT_NONE) {
+        if (encode_chunk(tokenizer, text, size, ids, ids_size, workspace) != 0) {
+            *ids_size = 0;
+            return -1;
+        }
+        return 0;
+    }
+    int cached = workspace->cache_limit > 0;
+    if (cached && encode_cache_reserve(workspace, tokenizer) != 0) {
+        return -1;
+    }
+
+    const unsigned char *bytes = (const unsigned char*)text;
+    size_t n = 0;
+    for (size_t i = 0; i < size; ) {
+        size_t length = split_chunk(tokenizer->split_pattern, bytes + i, text_size - i);
+        size_t chunk_ids_size;
+        if (length == 1) {
+            ids[n] = bytes[i];
+            chunk_ids_size = 1;
+        } else if (!cached || length > ENCODE_CACHE_MAX_CHUNK) {
+            workspace->cache_misses++;
+            if (encode_chunk(tokenizer, text + i, length, ids + n, &chunk_ids_size, workspace) != 0) {
+                return -1;
+            }
+        } else {
+            uint64_t hash = hash_bytes(bytes + i, length);
+            size_t slot = encode_cache_slot(workspace, bytes + i, length, hash);
+            if (workspace->cache_slots[slot] != 0) {
+                CacheEntry *entry = &workspace->cache[workspace->cache_slots[slot] - 1];
+                chunk_ids_size = entry->ids_size;
+                memcpy(ids + n, entry->ids, chunk_ids_size * sizeof(int));
+                entry->referenced = 1;
+                workspace->cache_hits++;
+            } else {
+                workspace->cache_misses++;
+                if (encode_chunk(tokenizer, text + i, length, ids + n, &chunk_ids_size, workspace) != 0) {
+                    return -1;
+                }
+                size_t victim = encode_cache_victim(workspace);
+                // Evicting can shift the slot the chunk was about to take.
+                slot = encode_cache_slot(workspace, bytes + i, length, hash);
+                CacheEntry *entry = &workspace->cache[victim];
+                entry->hash = hash;
+                memcpy(entry->bytes, bytes + i, length);
+                memcpy(entry->ids, ids + n, chunk_ids_size * sizeof(int));
+                entry->length = (unsigned char)length;
+                entry->ids_size = (unsigned char)chunk_ids_size;
+                entry->referenced = 0;
+                workspace->cache_slots[slot] = victim + 1;
+            }
+        }
+        n += chunk_ids_size;
+        i += length;
+    }
+    *ids_size = n;
+    return 0;
+}
+
+/*
+* @brief Encodes `text_size` bytes using the caller's workspace.
+*
+* Without a split pattern the whole text is encoded as one chunk. With one,
+* every chunk is encoded on its own, and the ids of chunks of 2 to
+* ENCODE_CACHE_MAX_CHUNK bytes are cached in the workspace, so repeated words
+* are looked up instead of merged again. Once the cache is full, chunks that
+* have not been hit recently are evicted. The cache is dropped when the
+* workspace is used with a different tokenizer or after the tokenizer has
+* learned new merges.
+*
+* @param tokenizer Pointer to the trained BasicTokenizer.
+* @param text The bytes to encode; may contain NULs.
+* @param text_size Number of bytes in text.
+* @param ids Output array to store the resulting token IDs; must hold text_size IDs.
+* @param ids_size Pointer to store the number of token IDs generated.
+* @param workspace Workspace from create_encode_workspace(), reused across calls.
+* @return 0 on success, -1 if allocation fails.
+*/
+int encode_with_workspace(const BasicTokenizer *tokenizer, const char *text, size_t text_size,
+                          int *ids, size_t *ids_size, EncodeWorkspace *workspace) {
+    return encode_prefix(tokenizer, text, text_size, text_size, ids, ids_size, workspace);
+}
+
+/*
+* @brief Encodes the given text into token IDs using the trained tokenizer.
+*
+* @param tokenizer Pointer to the trained BasicTokenizer.
+* @param text The input text to encode.
+* @param ids Output array to store the resulting token IDs; must hold strlen(text) IDs.
+* @param ids_size Pointer to store the number of token IDs generated.
+*/
+void encode(BasicTokenizer *tokenizer, const char *text, int *ids, size_t *ids_size) {
+    encode_bytes(tokenizer, text, strlen(text), ids, ids_size);
+}
+
+/*
+* @brief Encodes `size` bytes of arbitrary data into token IDs.
+*
+* Same as encode(), but the input is not NUL-terminated and may contain NULs.
+* Encoding never produces more IDs than there are input bytes, so `size` IDs
+* is always enough room. As with minbpe's default, special tokens are not
+* recognised and the text must not contain any; see encode_special().
+*
+* @param tokenizer Pointer to the trained BasicTokenizer.
+* @param data The bytes to encode.
+* @param size Number of bytes in data.
+* @param ids Output array to store the resulting token IDs; must hold size IDs.
+* @param ids_size Pointer to store the number of token IDs generated.
+* @return 0 on success, -1 if allocation fails or the text contains a special token.
+*/
+int encode_bytes(const BasicTokenizer *tokenizer, const char *data, size_t size, int *ids, size_t *ids_size) {
+    return encode_special(tokenizer, data, size, SPECIAL_NONE_RAISE, NULL, 0, ids, ids_size);
+}
+
+/*
+* @brief Encodes `size` bytes, emitting the ids of special tokens where their strings occur.
+*
+* Follows minbpe's allowed_special. The recognised special tokens are found in
+* a single pass of the Aho-Corasick automaton; where two overlap, the one
+* starting first wins, then the one registered first. The text between them is
+* encoded as usual. With SPECIAL_NONE_RAISE no special token is recognised and
+* the call fails if the text contains one; with SPECIAL_NONE their strings are
+* encoded like any other text.
+*
+* @param tokenizer Pointer to the trained BasicTokenizer.
+* @param data The bytes to encode; may contain NULs.
+* @param size Number of bytes in data.
+* @param policy Which special tokens to recognise.
+* @param allowed_ids With SPECIAL_CUSTOM, the ids of the special tokens to recognise.
+* @param num_allowed Number of ids in allowed_ids.
+* @param ids Output array to store the resulting token IDs; must hold size IDs.
+* @param ids_size Pointer to store the number of token IDs generated.
+* @return 0 on success, -1 if allocation fails or, with SPECIAL_NONE_RAISE, the text contains a special token.
+*/
+int encode_special(const BasicTokenizer *tokenizer, const char *data, size_t size, SpecialPolicy policy,
+                   const int *allowed_ids, size_t num_allowed, int *ids, size_t *ids_size) {
+    const SpecialTokens *specials = &tokenizer->specials;
+    unsigned char *allowed = NULL;
+    int any_allowed = 0;
+    if (policy != SPECIAL_NONE && specials->size > 0) {
+        allowed = (unsigned char*)mem_calloc(tokenizer->allocator, specials->size, 1);
+        if (!allowed) {
+            *ids_size = 0;
+            return -1;
+        }
+        for (size_t k = 0; k < specials->size; ++k) {
+            allowed[k] = policy != SPECIAL_CUSTOM;
+        }
+        for (size_t i = 0; policy == SPECIAL_CUSTOM && i < num_allowed; ++i) {
+            const size_t *index = pair_table_find(&specials->by_id, (IntPair){ allowed_ids[i], 0 });
+            if (index && *index != 0) {
+                allowed[*index - 1] = 1;
+            }
+        }
+        for (size_t k = 0; k < specials->size; ++k) {
+            any_allowed |= allowed[k];
+        }
+    }
+
+    EncodeWorkspace workspace;
+    encode_workspace_init(&workspace, tokenizer->allocator);
+    const unsigned char *bytes = (const unsigned char*)data;
+    int status = 0;
+    size_t n = 0;
+    for (size_t pos = 0; pos <= size && status == 0; ) {
+        size_t start = 0, index = 0;
+        int found = any_allowed && find_special(specials, allowed, bytes + pos, size - pos, &start, &index);
+        if (found && policy == SPECIAL_NONE_RAISE) {
+            status = -1;
+            break;
+        }
+        size_t end = found ? pos + start : size;
+        size_t count;
+        status = encode_with_workspace(tokenizer, data + pos, end - pos, ids + n, &count, &workspace);
+        if (status != 0) {
+            break;
+        }
+        n += count;
+        if (!found) {
+            break;
+        }
+        ids[n++] = specials->ids[index];
+        pos = end + specials->offsets[index + 1] - specials->offsets[index];
+    }
+    encode_workspace_free(&workspace);
+    mem_free(tokenizer->allocator, allowed);
+    *ids_size = status == 0 ? n : 0;
+    return status;
+}
+
+/*
+* @brief Checks that `data` contains none of the tokenizer's special tokens.
+*
+* Used by the entry points that follow encode_bytes()'s SPECIAL_NONE_RAISE
+* policy without going through encode_special().
+*
+* @return 0 if there is none, -1 if there is one or allocation fails.
+*/
+static int check_no_special(const BasicTokenizer *tokenizer, const char *data, size_t size) {
+    const SpecialTokens *specials = &tokenizer->specials;
+    if (specials->size == 0) {
+        return 0;
+    }
+    unsigned char *allowed = (unsigned char*)mem_alloc(tokenizer->allocator, specials->size);
+    size_t start, index;
+    if (allowed) {
+        memset(allowed, 1, specials->size);
+    }
+    int found = !allowed || find_special(specials, allowed, (const unsigned char*)data, size, &start, &index);
+    mem_free(tokenizer->allocator, allowed);
+    return found ? -1 : 0;
+}
+
+/*
+* @brief Returns how many bytes each token id of the tokenizer needs.
+*
+* Covers every id the tokenizer can produce, the special tokens included, so
+* it is the width to pick between encode_u16() and encode_u32().
+*
+* @param tokenizer Pointer to the trained BasicTokenizer.
+* @return sizeof(uint16_t) if every id is below 65536, sizeof(uint32_t) otherwise.
+*/
+size_t token_id_width(const BasicTokenizer *tokenizer) {
+    size_t max_id = tokenizer->vocab_size - 1;
+    for (size_t k = 0; k < tokenizer->specials.size; ++k) {
+        if ((size_t)tokenizer->specials.ids[k] > max_id) {
+            max_id = (size_t)tokenizer->specials.ids[k];
+        }
+    }
+    return max_id <= UINT16_MAX ? sizeof(uint16_t) : sizeof(uint32_t);
+}
+
+/*
+* @brief Encodes `size` bytes into 16-bit token IDs.
+*
+* Same as encode_bytes(), but each id takes two bytes, which halves the size
+* of a tokenized dataset. Only valid when token_id_width() is 2. With a split
+* pattern the text is encoded in slices of about ENCODE_SLICE_SIZE bytes that
+* end on chunk boundaries, and each slice's ids are narrowed into `ids` as it
+* is done, so the only scratch besides the workspace is one slice of ints.
+* Without a split pattern the text is a single chunk and the scratch holds
+* `size` ints.
+*
+* @param tokenizer Pointer to the trained BasicTokenizer.
+* @param data The bytes to encode; may contain NULs.
+* @param size Number of bytes in data.
+* @param ids Output array to store the resulting token IDs; must hold size IDs.
+* @param ids_size Pointer to store the number of token IDs generated.
+* @return 0 on success, -1 if an id does not fit in 16 bits, allocation fails or the text contains a special token.
+*/
+int encode_u16(const BasicTokenizer *tokenizer, const char *data, size_t size, uint16_t *ids, size_t *ids_size) {
+    const Allocator *allocator = tokenizer->allocator;
+    const unsigned char *bytes = (const unsigned char*)data;
+    *ids_size = 0;
+    // As in encode_bytes(), no special token may occur; a slice could cut one in two.
+    if (token_id_width(tokenizer) != sizeof(uint16_t) || check_no_special(tokenizer, data, size) != 0) {
+        return -1;
+    }
+
+    EncodeWorkspace workspace;
+    encode_workspace_init(&workspace, allocator);
+    int *slice = NULL;
+    size_t slice_capacity = 0;
+    int status = 0;
+    size_t n = 0;
+    for (size_t pos = 0; pos < size && status == 0; ) {
+        size_t end = size;
+        if (tokenizer->split_pattern != SPLIT_NONE) {
+            // Chunks are found from the start of the text, so a slice ending on a boundary encodes as it would whole.
+            end = pos;
+            do {
+                end += split_chunk(tokenizer->split_pattern, bytes + end, size - end);
+            } while (end < size && end - pos < ENCODE_SLICE_SIZE);
+        }
+        if (end - pos > slice_capacity) {
+            size_t capacity = slice_capacity * 2 > end - pos ? slice_capacity * 2 : end - pos;
+            int *grown = (int*)mem_realloc(allocator, slice, capacity * sizeof(int));
+            if (!grown) {
+                status = -1;
+                break;
+            }
+            slice = grown;
+            slice_capacity = capacity;
+        }
+        size_t count;
+        status = encode_prefix(tokenizer, data + pos, end - pos, size - pos, slice, &count, &workspace);
+        for (size_t i = 0; i < count && status == 0; ++i) {
+            ids[n++] = (uint16_t)slice[i];
+        }
+        pos = end;
+    }
+    encode_workspace_free(&workspace);
+    mem_free(allocator, slice);
+    *ids_size = status == 0 ? n : 0;
+    return status;
+}
+
+/*
+* @brief Encodes `size` bytes into 32-bit token IDs.
+*
+* Same as encode_bytes(), but the ids are written as uint32_t, for
+* vocabularies too large for encode_u16().
+*
+* @param tokenizer Pointer to the trained BasicTokenizer.
+* @param data The bytes to encode; may contain NULs.
+* @param size Number of bytes in data.
+* @param ids Output array to store the resulting token IDs; must hold size IDs.
+* @param ids_size Pointer to store the number of token IDs generated.
+* @return 0 on success, -1 if allocation fails or the text contains a special token.
+*/
+int encode_u32(const BasicTokenizer *tokenizer, const char *data, size_t size, uint32_t *ids, size_t *ids_size) {
+    // Ids are never negative, so they are encoded in place and reinterpreted.
+    return encode_bytes(tokenizer, data, size, (int*)ids, ids_size);
+}
+
+/*
+* @brief Rebuilds the pair -> rank index over the tokenizer's merges.
+*
+* Called after training or loading so that merge_rank() is a single hash
+* lookup instead of a scan over every merge. The slots live in the arena; a
+* rebuild reuses them while they are large enough, so rebuilding does not
+* leave a dead copy in the arena every time.
+*
+* @param tokenizer Pointer to the BasicTokenizer.
+* @return 0 on success, -1 if allocation fails.
+*/
+int build_merge_index(BasicTokenizer *tokenizer) {
+    // A mapped tokenizer's index is in the read-only file and is never rebuilt in place.
+    PairTable *index = &tokenizer->merge_ranks;
+    int reuse = !tokenizer->mapping && index->capacity > 0 && index->capacity / 2 >= tokenizer->num_merges;
+    PairTable ranks;
+    if (pair_table_init_with_allocator(&ranks, reuse ? index->capacity / 2 : tokenizer->num_merges,
+                                       tokenizer->allocator) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < tokenizer->num_merges; ++i) {
+        size_t *rank = pair_table_get(&ranks, tokenizer->merges[i].pair);
+        if (*rank == 0) {
+            // Stored off by one so that 0 means no merge.
+            *rank = i + 1;
+        }
+    }
+
+    // Lookups never iterate, so only the slots are copied into the arena.
+    uint64_t *keys = reuse ? index->keys : (uint64_t*)arena_alloc(&tokenizer->arena, ranks.capacity * sizeof(uint64_t));
+    size_t *values = reuse ? index->values : (size_t*)arena_alloc(&tokenizer->arena, ranks.capacity * sizeof(size_t));
+    if (keys && values) {
+        memcpy(keys, ranks.keys, ranks.capacity * sizeof(uint64_t));
+        memcpy(values, ranks.values, ranks.capacity * sizeof(size_t));
+        tokenizer->merge_ranks = (PairTable){ keys, values, NULL, ranks.size, ranks.capacity, NULL };
+    }
+    pair_table_free(&ranks);
+    return keys && values ? 0 : -1;
+}
+
+/*
+* @brief Looks up the rank of a pair among the tokenizer's merges.
+*
+* @param tokenizer Pointer to the BasicTokenizer.
+* @param pair The pair to look up.
+* @return The index of the merge for the pair, or num_merges if the pair is never merged.
+*/
+size_t merge_rank(const BasicTokenizer *tokenizer, IntPair pair) {
+    const size_t *rank = pair_table_find(&tokenizer->merge_ranks, pair);
+    return rank ? *rank - 1 : tokenizer->num_merges;
+}
+
+typedef struct {
+    const BasicTokenizer *tokenizer;
+    const char *const *docs;
+    const size_t *doc_sizes;
+    int *ids;
+    const size_t *starts;
+    size_t *counts;
+    EncodeWorkspace *workspaces;
+} EncodeBatchTask;
+
+static void encode_batch_doc(void *context, size_t task, int worker) {
+    const EncodeBatchTask *batch = (const EncodeBatchTask*)context;
+    if (check_no_special(batch->tokenizer, batch->docs[task], batch->doc_sizes[task]) != 0 ||
+        encode_with_workspace(batch->tokenizer, batch->docs[task], batch->doc_sizes[task],
+                              batch->ids + batch->starts[task], &batch->counts[task], &batch->workspaces[worker]) != 0) {
+        batch->counts[task] = SIZE_MAX;
+    }
+}
+
+/*
+* @brief Encodes a batch of documents on a thread pool into one output buffer.
+*
+* Each document is given by a pointer and a length and may contain any bytes.
+* Documents are handed to the pool's threads one at a time, and every thread
+* keeps a single workspace that it reuses for all the documents it encodes.
+* The ids of document i end up in ids[offsets[i] .. offsets[i + 1]) and are
+* those encode_bytes() gives for it; like encode_bytes(), a document must not
+* contain a special token.
+*
+* @param tokenizer Pointer to the trained BasicTokenizer.
+* @param docs Array of pointers to the documents.
+* @param doc_sizes Length in bytes of each document.
+* @param num_docs Number of documents.
+* @param ids Output buffer; must hold as many IDs as the documents have bytes in total.
+* @param offsets Output array of num_docs + 1 offsets into ids.
+* @param pool Thread pool to encode on, or NULL to encode on the calling thread.
+* @return 0 on success, -1 if allocation fails or a document contains a special token. The
+*         documents that failed are left empty; the others are still encoded.
+*/
+int encode_batch(const BasicTokenizer *tokenizer, const char *const *docs, const size_t *doc_sizes, size_t num_docs,
+                 int *ids, size_t *offsets, ThreadPool *pool) {
+    int num_workers = thread_pool_size(pool);
+    const Allocator *allocator = tokenizer->allocator;
+    size_t *counts = (size_t*)mem_alloc(allocator, (num_docs + 1) * sizeof(size_t));
+    EncodeWorkspace *workspaces = (EncodeWorkspace*)mem_alloc(allocator, num_workers * sizeof(EncodeWorkspace));
+    if (!counts || !workspaces) {
+        mem_free(allocator, counts);
+        mem_free(allocator, workspaces);
+        return -1;
+    }
+    for (int w = 0; w < num_workers; ++w) {
+        encode_workspace_init(&workspaces[w], allocator);
+    }
+
+    // Encode every document in place at its byte offset, then close the gaps.
+    offsets[0] = 0;
+    for (size_t i = 0; i < num_docs; ++i) {
+        offsets[i + 1] = offsets[i] + doc_sizes[i];
+    }
+    EncodeBatchTask batch = { tokenizer, docs, doc_sizes, ids, offsets, counts, workspaces };
+    thread_pool_run(pool, encode_batch_doc, &batch, num_docs);
+
+    int status = 0;
+    size_t total = 0;
+    for (size_t i = 0; i < num_docs; ++i) {
+        if (counts[i] == SIZE_MAX) {
+            status = -1;
+            counts[i] = 0;
+        }
+        memmove(ids + total, ids + offsets[i], counts[i] * sizeof(int));
+        offsets[i] = total;
+        total += counts[i];
+    }
+    offsets[num_docs] = total;
+
+    for (int w = 0; w < num_workers; ++w) {
+        encode_workspace_free(&workspaces[w]);
+    }
+    mem_free(allocator, workspaces);
+    mem_free(allocator, counts);
+    return status;
+}
+
+/*
+* @brief Creates a streaming encoder for a trained tokenizer.
+*
+* Builds a byte trie over the vocab, used to find positions in the buffered
+* input that no token can span.
+*
+* @param tokenizer Pointer to the trained BasicTokenizer; must outlive the encoder.
+* @return A pointer to the new StreamEncoder, or NULL if allocation fails.
+*/
+StreamEncoder* create_stream_encoder(const BasicTokenizer *tokenizer) {
+    const Allocator *allocator = tokenizer->allocator;
+    StreamEncoder *encoder = (StreamEncoder*)mem_calloc(allocator, 1, sizeof(StreamEncoder));
+    if (!encoder) {
+        return NULL;
+    }
+    encoder->tokenizer = tokenizer;
+    encoder->allocator = allocator;
+    encode_workspace_init(&encoder->workspace, allocator);
+    size_t max_nodes = tokenizer->vocab_offsets[tokenizer->vocab_size] + 1;
+    encoder->trie_token = (unsigned char*)mem_calloc(allocator, max_nodes, 1);
+    if (!encoder->trie_token || pair_table_init_with_allocator(&encoder->trie, max_nodes, allocator) != 0) {
+        clean_stream_encoder(encoder);
+        return NULL;
+    }
+
+    // Single-byte tokens never span a boundary, so only longer tokens are added.
+    size_t num_nodes = 1;
+    encoder->max_token_size = 1;
+    for (size_t id = INITIAL_VOCAB_SIZE; id < tokenizer->vocab_size; ++id) {
+        size_t length;
+        const unsigned char *bytes = token_bytes(tokenizer, (int)id, &length);
+        size_t node = 0;
+        for (size_t i = 0; i < length; ++i) {
+            size_t *child = pair_table_get(&encoder->trie, (IntPair){ (int)node, bytes[i] });
+            if (*child == 0) {
+                *child = num_nodes++;
+            }
+            node = *child;
+        }
+        encoder->trie_token[node] = 1;
+        if (length > encoder->max_token_size) {
+            encoder->max_token_size = length;
+        }
+    }
+    return encoder;
+}
+
+/*
+* @brief Frees a StreamEncoder, discarding any bytes it still holds.
+*
+* @param encoder Pointer to the StreamEncoder to be cleaned up.
+*/
+void clean_stream_encoder(StreamEncoder *encoder) {
+    const Allocator *allocator = encoder->allocator;
+    pair_table_free(&encoder->trie);
+    mem_free(allocator, encoder->trie_token);
+    mem_free(allocator, encoder->buffer);
+    mem_free(allocator, encoder->ids);
+    encode_workspace_free(&encoder->workspace);
+    mem_free(allocator, encoder);
+}
+
+// Whether some token occurrence in the buffer starts before `split` and ends after it.
+static int token_spans(const StreamEncoder *encoder, size_t split) {
+    const unsigned char *text = (const unsigned char*)encoder->buffer;
+    size_t first = split >= encoder->max_token_size ? split - encoder->max_token_size + 1 : 0;
+    for (size_t start = first; start < split; ++start) {
+        size_t node = 0;
+        for (size_t i = start; i < encoder->buffer_size; ++i) {
+            const size_t *child = pair_table_find(&encoder->trie, (IntPair){ (int)node, text[i] });
+            if (!child) {
+                break;
+            }
+            node = *child;
+            if (i >= split && encoder->trie_token[node]) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Encodes the first `size` buffered bytes, hands the ids to the sink and drops them.
+static int stream_encoder_emit(StreamEncoder *encoder, size_t size, TokenSink sink, void *user) {
+    if (size == 0) {
+        return 0;
+    }
+    if (size > encoder->ids_capacity) {
+        int *ids = (int*)mem_realloc(encoder->allocator, encoder->ids, size * sizeof(int));
+        if (!ids) {
+            return -1;
+        }
+        encoder->ids = ids;
+        encoder->ids_capacity = size;
+    }
+    size_t ids_size;
+    if (encode_prefix(encoder->tokenizer, encoder->buffer, size, encoder->buffer_size,
+                      encoder->ids, &ids_size, &encoder->workspace) != 0) {
+        return -1;
+    }
+    sink(user, encoder->ids, ids_size);
+    encoder->buffer_size -= size;
+    memmove(encoder->buffer, encoder->buffer + size, encoder->buffer_size);
+    // No token crosses the split, so the ones crossing later splits start after it and stay in the buffer.
+    encoder->spanned = encoder->spanned > size ? encoder->spanned - size : 0;
+    encoder->rescan_size = 0;
+    return 0;
+}
+
+/*
+* @brief End of the last chunk of `data` that cannot change when more bytes follow.
+*
+* Matching a chunk looks one character past its end, up to three bytes ahead
+* for a contraction, and through the whole run of whitespace when the chunk
+* starts with whitespace. A chunk is final once everything its match looked
+* at is complete and inside the buffer.
+*/
+static size_t final_chunks_end(SplitPattern pattern, const unsigned char *data, size_t size) {
+    size_t complete = size - utf8_incomplete_suffix(data, size);
+    size_t end = 0;
+    while (end < complete) {
+        size_t length = split_chunk(pattern, data + end, complete - end);
+        size_t seen = end + length;
+        if (data[end] == '\'' && seen < end + 3) {
+            seen = end + 3;
+        }
+        size_t space_end = class_run(data, complete, end, CHAR_SPACE);
+        if (space_end > seen) {
+            seen = space_end;
+        }
+        if (seen >= complete) {
+            break;
+        }
+        end += length;
+    }
+    return end;
+}
+
+/*
+* @brief Feeds bytes to a streaming encoder and emits every token that is final.
+*
+* A position is final once no token of the vocab can cross it. Tokens end
+* before or at that position whatever follows, so the ids before it are the
+* same as encode() gives for the whole text. Only the bytes after the last such
+* position are held back, at least max_token_size - 1 of them. With a split
+* pattern, chunks are encoded on their own, so everything up to the last chunk
+* that more input cannot change is final.
+*
+* There is no bound on what is held back. A run in which every position is
+* crossed by a token, such as a long run of spaces when the vocab has tokens
+* of several spaces, is held until it ends, as is an unfinished chunk with a
+* split pattern. Each byte is checked for a split once, and when a push emits
+* nothing the chunks are looked at again only after the buffer has doubled,
+* so the time stays linear in the input.
+*
+* @param encoder Pointer to the StreamEncoder.
+* @param data Next bytes of the input; may contain NULs.
+* @param size Number of bytes in data.
+* @param sink Called with each run of final token IDs.
+* @param user Pointer passed to sink.
+* @return 0 on success, -1 if allocation fails.
+*/
+int stream_encoder_push(StreamEncoder *encoder, const char *data, size_t size, TokenSink sink, void *user) {
+    if (encoder->buffer_size + size > encoder->buffer_capacity) {
+        size_t capacity = encoder->buffer_capacity ? encoder->buffer_capacity : 4096;
+        while (capacity < encoder->buffer_size + size) {
+            capacity *= 2;
+        }
+        char *buffer = (char*)mem_realloc(encoder->allocator, encoder->buffer, capacity);
+        if (!buffer) {
+            return -1;
+        }
+        encoder->buffer = buffer;
+        encoder->buffer_capacity = capacity;
+    }
+    if (size > 0) {
+        memcpy(encoder->buffer + encoder->buffer_size, data, size);
+    }
+    encoder->buffer_size += size;
+
+    SplitPattern pattern = encoder->tokenizer->split_pattern;
+    if (pattern != SPLIT_NONE) {
+        if (encoder->buffer_size < encoder->rescan_size) {
+            return 0;
+        }
+        size_t split = final_chunks_end(pattern, (const unsigned char*)encoder->buffer, encoder->buffer_size);
+        if (split == 0) {
+            encoder->rescan_size = 2 * encoder->buffer_size;
+            return 0;
+        }
+        return stream_encoder_emit(encoder, split, sink, user);
+    }
+
+    // Every token crossing a split at or below this point lies inside the buffer.
+    if (encoder->buffer_size < encoder->max_token_size) {
+        return 0;
+    }
+    size_t top = encoder->buffer_size - encoder->max_token_size + 1;
+    for (size_t split = top; split > encoder->spanned; --split) {
+        if (!token_spans(encoder, split)) {
+            // Splits above this one were just found to be crossed.
+            encoder->spanned = top;
+            return stream_encoder_emit(encoder, split, sink, user);
+        }
+    }
+    // A split stays crossed whatever follows, so the next push only checks new ones.
+    encoder->spanned = top;
+    return 0;
+}
+
+/*
+* @brief Encodes and emits everything the encoder still holds.
+*
+* The encoder is left empty and can be used for another stream.
+*
+* @param encoder Pointer to the StreamEncoder.
+* @param sink Called with the remaining token IDs.
+* @param user Pointer passed to sink.
+* @return 0 on success, -1 if allocation fails.
+*/
+int stream_encoder_finish(StreamEncoder *encoder, TokenSink sink, void *user) {
+    return stream_encoder_emit(encoder, encoder->buffer_size, sink, user);
+}
+
+/*
+* @brief Encodes everything a byte source produces, emitting ids as they become final.
+*
+* @param tokenizer Pointer to the trained BasicTokenizer.
+* @param source Called to read the next bytes; returns 0 at the end of the input.
+* @param source_user Pointer passed to source.
+* @param sink Called with each run of token IDs.
+* @param sink_user Pointer passed to sink.
+* @return 0 on success, -1 if allocation fails.
+*/
+int encode_stream(const BasicTokenizer *tokenizer, ByteSource source, void *source_user, TokenSink sink, void *sink_user) {
+    StreamEncoder *encoder = create_stream_encoder(tokenizer);
+    char *chunk = (char*)mem_alloc(tokenizer->allocator, 65536);
+    int status = encoder && chunk ? 0 : -1;
+    size_t size;
+    while (status == 0 && (size = source(source_user, chunk, 65536)) > 0) {
+        status = stream_encoder_push(encoder, chunk, size, sink, sink_user);
+    }
+    if (status == 0) {
+        status = stream_encoder_finish(encoder, sink, sink_user);
+    }
+    if (encoder) {
+        clean_stream_encoder(encoder);
+    }
+    mem_free(tokenizer->allocator, chunk);
+    return status;
+}
+
+/*
+* @brief Prepares a StreamDecoder for a new sequence of tokens.
+*
+* @param decoder Pointer to the StreamDecoder to initialize.
+* @param tokenizer Pointer to the BasicTokenizer used for decoding; must outlive the decoder.
+*/
+void stream_decoder_init(StreamDecoder *decoder, const BasicTokenizer *tokenizer) {
+    decoder->tokenizer = tokenizer;
+    decoder->pending_size = 0;
+}
+
+/*
+* @brief Decodes one token, writing every byte that completes valid text so far.
+*
+* The bytes of an unfinished UTF-8 sequence at the end are kept until a later
+* token completes it. Bytes that can never form valid UTF-8 are passed through
+* unchanged rather than held. No NUL is written. The cost is O(token length).
+*
+* @param decoder Pointer to the StreamDecoder.
+* @param id The next token ID.
+* @param text Output buffer with room for the token's length plus 3 bytes.
+* @return Number of bytes written to text.
+*/
+size_t stream_decoder_push(StreamDecoder *decoder, int id, char *text) {
+    size_t length;
+    const unsigned char *bytes = token_bytes(decoder->tokenizer, id, &length);
+    memcpy(text, decoder->pending, decoder->pending_size);
+    memcpy(text + decoder->pending_size, bytes, length);
+    length += decoder->pending_size;
+
+    decoder->pending_size = utf8_incomplete_suffix((const unsigned char*)text, length);
+    length -= decoder->pending_size;
+    memcpy(decoder->pending, text + length, decoder->pending_size);
+    return length;
+}
+
+/*
+* @brief Writes out any bytes still held back, at the end of a sequence.
+*
+* @param decoder Pointer to the StreamDecoder.
+* @param text Output buffer with room for 3 bytes.
+* @return Number of bytes written to text.
+*/
+size_t stream_decoder_flush(StreamDecoder *decoder, char *text) {
+    size_t length = decoder->pending_size;
+    memcpy(text, decoder->pending, length);
+    decoder->pending_size = 0;
+    return length;
+}
+
+/*
+* @brief Returns the bytes a token expands to.
+*
+* @param tokenizer Pointer to the BasicTokenizer.
+* @param id The token ID.
+* @param length Pointer to store the number of bytes.
+* @return Pointer to the token's bytes, not NUL-terminated. Special tokens give
+*         their string and unknown ids give no bytes.
+*/
+const unsigned char* token_bytes(const BasicTokenizer *tokenizer, int id, size_t *length) {
+    if (id >= 0 && (size_t)id < tokenizer->vocab_size) {
+        const size_t *offsets = tokenizer->vocab_offsets;
+        *length = offsets[id + 1] - offsets[id];
+        return tokenizer->vocab + offsets[id];
+    }
+    const SpecialTokens *specials = &tokenizer->specials;
+    const size_t *index = specials->size > 0 ? pair_table_find(&specials->by_id, (IntPair){ id, 0 }) : NULL;
+    if (!index || *index == 0) {
+        *length = 0;
+        return tokenizer->vocab;
+    }
+    *length = specials->offsets[*index] - specials->offsets[*index - 1];
+    return specials->bytes + specials->offsets[*index - 1];
+}
+
+/*
+* @brief Decodes a list of token IDs back into text.
+*
+* Behaves like snprintf: at most text_size - 1 bytes are written followed by
+* a terminating NUL, and the full decoded length is returned either way. Call
+* with text_size 0 to learn how large the buffer must be.
+*
+* @param tokenizer Pointer to the BasicTokenizer used for decoding.
+* @param ids Array of token IDs to decode.
+* @param ids_size Number of token IDs in the array.
+* @param text Output buffer to store the decoded text.
+* @param text_size Size of the output buffer in bytes.
+* @return Length of the decoded text, not counting the terminating NUL.
+*/
+size_t decode(const BasicTokenizer *tokenizer, const int *ids, size_t ids_size, char *text, size_t text_size) {
+    size_t room = text_size > 0 ? text_size - 1 : 0;
+    size_t length = decode_bytes(tokenizer, ids, ids_size, text, room);
+    if (text_size > 0) {
+        text[length < room ? length : room] = '\0';
+    }
+    return length;
+}
+
+/*
+* @brief Decodes a list of token IDs into raw bytes.
+*
+* Writes at most `capacity` bytes and no terminating NUL. The full decoded
+* length is returned even when it does not fit, so a call with capacity 0
+* reports the required buffer size.
+*
+* @param tokenizer Pointer to the BasicTokenizer used for decoding.
+* @param ids Array of token IDs to decode.
+* @param ids_size Number of token IDs in the array.
+* @param data Output buffer to store the decoded bytes.
+* @param capacity Size of the output buffer in bytes.
+* @return Number of decoded bytes.
+*/
+size_t decode_bytes(const BasicTokenizer *tokenizer, const int *ids, size_t ids_size, char *data, size_t capacity) {
+    size_t length = 0;
+    for (size_t i = 0; i < ids_size; ++i) {
+        size_t size;
+        const unsigned char *bytes = token_bytes(tokenizer, ids[i], &size);
+        if (length + size <= capacity) {
+            memcpy(data + length, bytes, size);
+        } else if (length < capacity) {
+            memcpy(data + length, bytes, capacity - length);
+        }
+        length += size;
+    }
+    return length;
+}
+
+
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+static int write_section(FILE *file, const void *data, size_t size) {
+    static const char padding[8] = { 0 };
+    if (size > 0 && fwrite(data, 1, size, file) != size) {
+        return -1;
+    }
+    size_t pad = align8(size) - size;
+    return pad > 0 && fwrite(padding, 1, pad, file) != pad ? -1 : 0;
+}
+
+/*
+* @brief Saves a trained tokenizer in the binary model format.
+*
+* The file holds the merges, the flat vocab and the merge-rank hash table
+* exactly as they are laid out in memory, so load_tokenizer() can use it
+* in place, followed by the special tokens.
+*
+* @param tokenizer Pointer to the BasicTokenizer to save.
+* @param path Path of the file to write.
+* @return 0 on success, -1 on failure.
+*/
+int save_tokenizer(const BasicTokenizer *tokenizer, const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return -1;
+    }
+
+    const PairTable *ranks = &tokenizer->merge_ranks;
+    const SpecialTokens *specials = &tokenizer->specials;
+    ModelHeader header;
+    memset(&header, 0, sizeof(ModelHeader));
+    memcpy(header.magic, MODEL_MAGIC, sizeof(header.magic));
+    header.version = MODEL_VERSION;
+    header.byte_order = MODEL_BYTE_ORDER;
+    header.num_merges = tokenizer->num_merges;
+    header.vocab_size = tokenizer->vocab_size;
+    header.vocab_bytes = tokenizer->vocab_offsets[tokenizer->vocab_size];
+    header.rank_capacity = ranks->capacity;
+    header.rank_size = ranks->size;
+    header.split_pattern = tokenizer->split_pattern;
+    header.num_specials = specials->size;
+    header.special_bytes = specials->size ? specials->offsets[specials->size] : 0;
+
+    int status = write_section(file, &header, sizeof(ModelHeader));
+    status |= write_section(file, tokenizer->merges, tokenizer->num_merges * sizeof(Merge));
+    status |= write_section(file, tokenizer->vocab_offsets, (tokenizer->vocab_size + 1) * sizeof(size_t));
+    status |= write_section(file, ranks->keys, ranks->capacity * sizeof(uint64_t));
+    status |= write_section(file, ranks->values, ranks->capacity * sizeof(size_t));
+    status |= write_section(file, tokenizer->vocab, header.vocab_bytes);
+    if (specials->size > 0) {
+        status |= write_section(file, specials->ids, specials->size * sizeof(int32_t));
+        status |= write_section(file, specials->offsets, (specials->size + 1) * sizeof(size_t));
+        status |= write_section(file, specials->bytes, header.special_bytes);
+    }
+    if (fclose(file) != 0) {
+        status = -1;
+    }
+    return status ? -1 : 0;
+}
+
+/*
+* @brief Checks that a mapped tokenizer's arrays cannot send encode or decode out of bounds.
+*
+* Every token's bytes must lie in order inside the vocab, every merge must
+* combine existing tokens into a token of the vocab, and every rank in the
+* merge-rank table must name a merge. The table must also have an empty slot,
+* so that lookups end. One pass over each array, with no allocation.
+*
+* @return 1 if the tokenizer is consistent, 0 otherwise.
+*/
+static int mapped_tokenizer_is_valid(const BasicTokenizer *tokenizer) {
+    const size_t *offsets = tokenizer->vocab_offsets;
+    if (offsets[0] != 0) {
+        return 0;
+    }
+    for (size_t id = 0; id < tokenizer->vocab_size; ++id) {
+        if (offsets[id + 1] <= offsets[id]) {
+            return 0;
+        }
+    }
+    for (size_t i = 0; i < tokenizer->num_merges; ++i) {
+        const Merge *m = &tokenizer->merges[i];
+        if (m->pair.first < 0 || (size_t)m->pair.first >= tokenizer->vocab_size ||
+            m->pair.second < 0 || (size_t)m->pair.second >= tokenizer->vocab_size ||
+            m->idx < INITIAL_VOCAB_SIZE || (size_t)m->idx >= tokenizer->vocab_size) {
+            return 0;
+        }
+    }
+    const PairTable *ranks = &tokenizer->merge_ranks;
+    size_t occupied = 0;
+    for (size_t slot = 0; slot < ranks->capacity; ++slot) {
+        if (ranks->keys[slot] == PAIR_TABLE_EMPTY) {
+            continue;
+        }
+        if (ranks->values[slot] == 0 || ranks->values[slot] > tokenizer->num_merges) {
+            return 0;
+        }
+        occupied++;
+    }
+    return occupied == ranks->size && occupied < ranks->capacity;
+}
+
+/*
+* @brief Loads a tokenizer saved by save_tokenizer() by mapping the file.
+*
+* Nothing is parsed or copied: the tokenizer's merges, vocab and merge-rank
+* table point straight into a read-only shared mapping, so processes that
+* load the same file share its pages. The result can encode and decode but
+* must not be trained further. clean_tokenizer() unmaps the file. Special
+* tokens are the exception: they are copied out so that their automaton can
+* be rebuilt. The arrays are checked once on load, in time linear in the
+* file, so a corrupt file is rejected rather than read out of bounds later.
+*
+* @param path Path of the file to load.
+* @return A pointer to the loaded BasicTokenizer, or NULL if the file is missing or invalid.
+*/
+BasicTokenizer* load_tokenizer(const char *path) {
+    return load_tokenizer_with_allocator(path, NULL);
+}
+
+/*
+* @brief Loads a tokenizer saved by save_tokenizer() that allocates through `allocator`.
+*
+* @param path Path of the file to load.
+* @param allocator Memory functions to use, or NULL for the C library; must outlive the tokenizer.
+* @return A pointer to the loaded BasicTokenizer, or NULL if the file is missing or invalid.
+*/
+BasicTokenizer* load_tokenizer_with_allocator(const char *path, const Allocator *allocator) {
+    void *mapping;
+    size_t file_size;
+    if (map_file(path, &mapping, &file_size) != 0) {
+        return NULL;
+    }
+    if (file_size < sizeof(ModelHeader)) {
+        if (mapping) {
+            munmap(mapping, file_size);
+        }
+        return NULL;
+    }
+
+    const ModelHeader *header = (const ModelHeader*)mapping;
+    unsigned char *base = (unsigned char*)mapping;
+    size_t merges_at = align8(sizeof(ModelHeader));
+    size_t offsets_at = merges_at + align8(header->num_merges * sizeof(Merge));
+    size_t keys_at = offsets_at + align8((header->vocab_size + 1) * sizeof(size_t));
+    size_t values_at = keys_at + align8(header->rank_capacity * sizeof(uint64_t));
+    size_t vocab_at = values_at + align8(header->rank_capacity * sizeof(size_t));
+
+    Arena arena = { NULL, allocator };
+    BasicTokenizer *tokenizer = NULL;
+    if (memcmp(header->magic, MODEL_MAGIC, sizeof(header->magic)) == 0 &&
+        header->version == MODEL_VERSION && header->byte_order == MODEL_BYTE_ORDER &&
+        sizeof(size_t) == sizeof(uint64_t) &&
+        header->vocab_size >= INITIAL_VOCAB_SIZE && header->vocab_size < INT32_MAX &&
+        header->num_merges < header->vocab_size &&
+        (header->rank_capacity & (header->rank_capacity - 1)) == 0 &&
+        header->rank_size < header->rank_capacity && header->split_pattern <= SPLIT_GPT4 &&
+        header->rank_capacity <= file_size / sizeof(uint64_t) &&
+        vocab_at <= file_size && header->vocab_bytes <= file_size - vocab_at &&
+        ((const size_t*)(base + offsets_at))[header->vocab_size] == header->vocab_bytes) {
+        tokenizer = (BasicTokenizer*)arena_alloc(&arena, sizeof(BasicTokenizer));
+    }
+    if (!tokenizer) {
+        munmap(mapping, file_size);
+        return NULL;
+    }
+    tokenizer->arena = arena;
+    tokenizer->allocator = allocator;
+    tokenizer->generation = next_generation();
+
+    tokenizer->merges = (Merge*)(base + merges_at);
+    tokenizer->num_merges = header->num_merges;
+    tokenizer->merges_capacity = header->num_merges;
+    tokenizer->vocab_capacity = header->vocab_bytes;
+    tokenizer->vocab = base + vocab_at;
+    tokenizer->vocab_offsets = (size_t*)(base + offsets_at);
+    tokenizer->vocab_size = header->vocab_size;
+    tokenizer->merge_ranks = (PairTable){ (uint64_t*)(base + keys_at), (size_t*)(base + values_at), NULL,
+                                          header->rank_size, header->rank_capacity, NULL };
+    tokenizer->split_pattern = (SplitPattern)header->split_pattern;
+    memset(&tokenizer->specials, 0, sizeof(SpecialTokens));
+    tokenizer->specials.allocator = allocator;
+    tokenizer->mapping = mapping;
+    tokenizer->mapping_size = file_size;
+    if (!mapped_tokenizer_is_valid(tokenizer)) {
+        clean_tokenizer(tokenizer);
+        return NULL;
+    }
+
+    if (header->num_specials > 0) {
+        size_t ids_at = vocab_at + align8(header->vocab_bytes);
+        size_t special_offsets_at = ids_at + align8(header->num_specials * sizeof(int32_t));
+        size_t special_bytes_at = special_offsets_at + align8((header->num_specials + 1) * sizeof(size_t));
+        const int32_t *ids = (const int32_t*)(base + ids_at);
+        const size_t *offsets = (const size_t*)(base + special_offsets_at);
+        int ok = header->num_specials < file_size / sizeof(size_t) && special_bytes_at <= file_size &&
+                 header->special_bytes <= file_size - special_bytes_at && offsets[0] == 0 &&
+                 offsets[header->num_specials] == header->special_bytes;
+        for (size_t k = 0; ok && k < header->num_specials; ++k) {
+            ok = offsets[k] < offsets[k + 1] && offsets[k + 1] <= header->special_bytes &&
+                 ids[k] >= 0 && (size_t)ids[k] >= tokenizer->vocab_size &&
+                 special_tokens_append(&tokenizer->specials, base + special_bytes_at + offsets[k],
+                                       offsets[k + 1] - offsets[k], ids[k]) == 0;
+        }
+        if (!ok || special_tokens_build(&tokenizer->specials) != 0) {
+            clean_tokenizer(tokenizer);
+            return NULL;
+        }
+    }
+    return tokenizer;
+}
+
+/*
+* @brief Writes a token the way minbpe's render_token() does.
+*
+* Invalid UTF-8 becomes U+FFFD and control characters are escaped as \\uXXXX.
+* Only C0/C1 controls and the common format characters are escaped; the
+* .vocab file is for people to read, and neither minbpe nor bpe.c loads it.
+*/
+static void write_rendered_token(FILE *file, const unsigned char *bytes, size_t length) {
+    size_t i = 0;
+    while (i < length) {
+        unsigned char c = bytes[i];
+        size_t need = c < 0x80 ? 0 : c >= 0xc2 && c <= 0xdf ? 1 : c >= 0xe0 && c <= 0xef ? 2 : c >= 0xf0 && c <= 0xf4 ? 3 : SIZE_MAX;
+        uint32_t cp = need == 0 ? c : need == 1 ? c & 0x1f : need == 2 ? c & 0x0f : c & 0x07;
+        size_t start = i++;
+        if (need == SIZE_MAX) {
+            fputs("\xef\xbf\xbd", file);
+            continue;
+        }
+        size_t got = 0;
+        while (got < need && i < length) {
+            unsigned char lo = 0x80, hi = 0xbf;
+            if (got == 0) {
+                lo = c == 0xe0 ? 0xa0 : c == 0xf0 ? 0x90 : 0x80;
+                hi = c == 0xed ? 0x9f : c == 0xf4 ? 0x8f : 0xbf;
+            }
+            if (bytes[i] < lo || bytes[i] > hi) {
+                break;
+            }
+            cp = (cp << 6) | (bytes[i++] & 0x3f);
+            got++;
+        }
+        if (got < need) {
+            fputs("\xef\xbf\xbd", file);
+        } else if (cp < 0x20 || (cp >= 0x7f && cp <= 0x9f) || cp == 0xad ||
+                   (cp >= 0x200b && cp <= 0x200f) || (cp >= 0x202a && cp <= 0x202e) ||
+                   (cp >= 0x2060 && cp <= 0x2064) || cp == 0xfeff) {
+            fprintf(file, "\\u%04x", (unsigned)cp);
+        } else {
+            fwrite(bytes + start, 1, i - start, file);
+        }
+    }
+}
+
+/*
+* @brief Saves a tokenizer in minbpe's text format.
+*
+* Writes `<file_prefix>.model`, which minbpe's load() reads, and the
+* human-readable `<file_prefix>.vocab`.
+*
+* @param tokenizer Pointer to the BasicTokenizer to save.
+* @param file_prefix Path prefix of the two files to write.
+* @return 0 on success, -1 on failure.
+*/
+int save_minbpe_model(const BasicTokenizer *tokenizer, const char *file_prefix) {
+    size_t prefix_size = strlen(file_prefix);
+    char *path = (char*)mem_alloc(tokenizer->allocator, prefix_size + sizeof(".model"));
+    if (!path) {
+        return -1;
+    }
+    int status = 0;
+
+    memcpy(path, file_prefix, prefix_size);
+    memcpy(path + prefix_size, ".model", sizeof(".model"));
+    FILE *file = fopen(path, "w");
+    if (file) {
+        const char *pattern = tokenizer->split_pattern == SPLIT_GPT2 ? GPT2_SPLIT_PATTERN
+                            : tokenizer->split_pattern == SPLIT_GPT4 ? GPT4_SPLIT_PATTERN : "";
+        const SpecialTokens *specials = &tokenizer->specials;
+        fprintf(file, "minbpe v1\n%s\n%zu\n", pattern, specials->size);
+        for (size_t k = 0; k < specials->size; ++k) {
+            fwrite(specials->bytes + specials->offsets[k], 1, specials->offsets[k + 1] - specials->offsets[k], file);
+            fprintf(file, " %d\n", specials->ids[k]);
+        }
+        for (size_t i = 0; i < tokenizer->num_merges; ++i) {
+            fprintf(file, "%d %d\n", tokenizer->merges[i].pair.first, tokenizer->merges[i].pair.second);
+        }
+        status |= fclose(file);
+    } else {
+        status = -1;
+    }
+
+    memcpy(path + prefix_size, ".vocab", sizeof(".vocab"));
+    file = fopen(path, "w");
+    if (file) {
+        for (size_t idx = 0; idx < tokenizer->vocab_size; ++idx) {
+            size_t length;
+            const unsigned char *bytes = token_bytes(tokenizer, (int)idx, &length);
+            if (idx >= INITIAL_VOCAB_SIZE) {
+                const Merge *m = &tokenizer->merges[idx - INITIAL_VOCAB_SIZE];
+                size_t first_size, second_size;
+                const unsigned char *first = token_bytes(tokenizer, m->pair.first, &first_size);
+                const unsigned char *second = token_bytes(tokenizer, m->pair.second, &second_size);
+                fputc('[', file);
+                write_rendered_token(file, first, first_size);
+                fputs("][", file);
+                write_rendered_token(file, second, second_size);
+                fputs("] -> ", file);
+            }
+            fputc('[', file);
+            write_rendered_token(file, bytes, length);
+            fprintf(file, "] %zu\n", idx);
+        }
+        // minbpe lists special tokens after the merged tokens, as plain entries.
+        const SpecialTokens *specials = &tokenizer->specials;
+        for (size_t k = 0; k < specials->size; ++k) {
+            fputc('[', file);
+            write_rendered_token(file, specials->bytes + specials->offsets[k], specials->offsets[k + 1] - specials->offsets[k]);
+            fprintf(file, "] %d\n", specials->ids[k]);
+        }
+        status |= fclose(file);
+    } else {
+        status = -1;
+    }
+
+    mem_free(tokenizer->allocator, path);
+    return status ? -1 : 0;
+}
+
+/*
+* @brief Loads a tokenizer from a minbpe `.model` file.
+*
+* The merges are replayed in file order, so the tokenizer assigns the same
+* ids as minbpe and encodes to identical ids. A split pattern must be empty
+* or exactly minbpe's GPT-2 or GPT-4 pattern, the only ones bpe.c can run.
+* Special token ids must lie above the merged tokens.
+*
+* @param model_file Path of the `.model` file written by minbpe's save().
+* @return A pointer to the loaded BasicTokenizer, or NULL if the file is missing or invalid.
+*/
+BasicTokenizer* load_minbpe_model(const char *model_file) {
+    return load_minbpe_model_with_allocator(model_file, NULL);
+}
+
+/*
+* @brief Loads a tokenizer from a minbpe `.model` file that allocates through `allocator`.
+*
+* @param model_file Path of the `.model` file written by minbpe's save().
+* @param allocator Memory functions to use, or NULL for the C library; must outlive the tokenizer.
+* @return A pointer to the loaded BasicTokenizer, or NULL if the file is missing or invalid.
+*/
+BasicTokenizer* load_minbpe_model_with_allocator(const char *model_file, const Allocator *allocator) {
+    FILE *file = fopen(model_file, "r");
+    if (!file) {
+        return NULL;
+    }
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    IntPair *pairs = NULL;
+    size_t num_pairs = 0, pairs_capacity = 0;
+    SplitPattern pattern = SPLIT_NONE;
+    int ok = getline(&line, &line_capacity, file) > 0 && strcmp(line, "minbpe v1\n") == 0 &&
+             getline(&line, &line_capacity, file) > 0;
+    if (ok && strcmp(line, GPT2_SPLIT_PATTERN "\n") == 0) {
+        pattern = SPLIT_GPT2;
+    } else if (ok && strcmp(line, GPT4_SPLIT_PATTERN "\n") == 0) {
+        pattern = SPLIT_GPT4;
+    } else if (ok && strcmp(line, "\n") != 0) {
+        ok = 0;
+    }
+
+    // Special tokens: a count, then one "<token> <id>" line each.
+    SpecialTokens specials;
+    memset(&specials, 0, sizeof(SpecialTokens));
+    specials.allocator = allocator;
+    size_t num_specials = 0;
+    char extra;
+    ok = ok && getline(&line, &line_capacity, file) > 0 && sscanf(line, "%zu %c", &num_specials, &extra) == 1;
+    for (size_t k = 0; ok && k < num_specials; ++k) {
+        ssize_t length = getline(&line, &line_capacity, file);
+        char *space = length > 0 ? strrchr(line, ' ') : NULL;
+        int id;
+        ok = space && space > line && sscanf(space + 1, "%d %c", &id, &extra) == 1 &&
+             special_tokens_append(&specials, (const unsigned char*)line, space - line, id) == 0;
+    }
+
+    while (ok && getline(&line, &line_capacity, file) > 0) {
+        IntPair pair;
+        if (sscanf(line, "%d %d %c", &pair.first, &pair.second, &extra) != 2 || pair.first < 0 || pair.second < 0 ||
+            (size_t)pair.first >= INITIAL_VOCAB_SIZE + num_pairs || (size_t)pair.second >= INITIAL_VOCAB_SIZE + num_pairs) {
+            ok = 0;
+            break;
+        }
+        if (num_pairs == pairs_capacity) {
+            pairs_capacity = pairs_capacity ? pairs_capacity * 2 : 1024;
+            IntPair *grown = (IntPair*)mem_realloc(allocator, pairs, pairs_capacity * sizeof(IntPair));
+            if (!grown) {
+                ok = 0;
+                break;
+            }
+            pairs = grown;
+        }
+        pairs[num_pairs++] = pair;
+    }
+    free(line);
+    fclose(file);
+    for (size_t k = 0; ok && k < specials.size; ++k) {
+        ok = specials.ids[k] >= 0 && (size_t)specials.ids[k] >= INITIAL_VOCAB_SIZE + num_pairs;
+    }
+
+    BasicTokenizer *tokenizer = ok ? create_tokenizer_with_allocator(allocator) : NULL;
+    if (tokenizer) {
+        tokenizer->split_pattern = pattern;
+        int status = reserve_tokenizer(tokenizer, INITIAL_VOCAB_SIZE + num_pairs);
+        for (size_t i = 0; status == 0 && i < num_pairs; ++i) {
+            status = add_merge(tokenizer, pairs[i], (int)(INITIAL_VOCAB_SIZE + i));
+        }
+        tokenizer->specials = specials;
+        if (status != 0 || build_merge_index(tokenizer) != 0 ||
+            (specials.size > 0 && special_tokens_build(&tokenizer->specials) != 0)) {
+            clean_tokenizer(tokenizer);
+            tokenizer = NULL;
+        }
+    } else {
+        special_tokens_free(&specials);
+    }
+    mem_free(allocator, pairs);
+    return tokenizer;
+}
+
+/*
+* @brief Finds the merge of a pair by scanning a merge list in order.
+*
+* Linear in the number of merges; a tokenizer looks pairs up with
+* merge_rank() instead, which uses the merge-rank hash index.
+*
+* @param merges Array of merges to search.
+* @param merges_size Number of merges in the array.
+* @param pair The pair to look for.
+* @return The index of the first merge of the pair, or merges_size if there is none.
+*/
+size_t find_pair_index(Merge *merges, size_t merges_size, IntPair pair) {
+    for (size_t i = 0; i < merges_size; ++i) {
+        if (merges[i].pair.first == pair.first && merges[i].pair.second == pair.second) {
+            return i;
+        }
+    }
+    return merges_size;
+}
+
+static uint64_t pack_pair(IntPair pair) {
+    return ((uint64_t)(uint32_t)pair.first << 32) | (uint32_t)pair.second;
+}
+
+static IntPair unpack_pair(uint64_t key) {
+    return (IntPair){ (int)(uint32_t)(key >> 32), (int)(uint32_t)key };
+}
+
+static size_t hash_pair(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (size_t)key;
+}
+
+static int pair_table_alloc(PairTable *table, size_t capacity, const Allocator *allocator) {
+    table->allocator = allocator;
+    table->keys = (uint64_t*)mem_alloc(allocator, capacity * sizeof(uint64_t));
+    table->values = (size_t*)mem_alloc(allocator, capacity * sizeof(size_t));
+    table->order = (size_t*)mem_alloc(allocator, (capacity / 2) * sizeof(size_t));
+    if (!table->keys || !table->values || !table->order) {
+        pair_table_free(table);
+        return -1;
+    }
+    memset(table->keys, 0xff, capacity * sizeof(uint64_t));
+    table->size = 0;
+    table->capacity = capacity;
+    return 0;
+}
+
+/*
+* @brief Initializes an empty PairTable.
+*
+* The table is sized so that `expected_pairs` distinct pairs fit without
+* growing, which keeps allocation out of the counting loop.
+*
+* @param table Pointer to the PairTable to initialize.
+* @param expected_pairs Number of distinct pairs the table should hold without resizing.
+* @return 0 on success, -1 if allocation fails.
+*/
+int pair_table_init(PairTable *table, size_t expected_pairs) {
+    return pair_table_init_with_allocator(table, expected_pairs, NULL);
+}
+
+/*
+* @brief Initializes an empty PairTable whose storage comes from `allocator`.
+*
+* @param table Pointer to the PairTable to initialize.
+* @param expected_pairs Number of distinct pairs the table should hold without resizing.
+* @param allocator Memory functions for the table, or NULL for the C library.
+* @return 0 on success, -1 if allocation fails.
+*/
+int pair_table_init_with_allocator(PairTable *table, size_t expected_pairs, const Allocator *allocator) {
+    size_t capacity = 16;
+    while (capacity / 2 < expected_pairs) {
+        capacity *= 2;
+    }
+    return pair_table_alloc(table, capacity, allocator);
+}
+
+/*
+* @brief Frees the storage owned by a PairTable.
+*
+* @param table Pointer to the PairTable to be cleaned up.
+*/
+void pair_table_free(PairTable *table) {
+    mem_free(table->allocator, table->keys);
+    mem_free(table->allocator, table->values);
+    mem_free(table->allocator, table->order);
+    table->keys = NULL;
+    table->values = NULL;
+    table->order = NULL;
+    table->size = 0;
+    table->capacity = 0;
+}
+
+/*
+* @brief Removes every pair from the table, keeping its storage.
+*
+* Runs in time proportional to the number of pairs present, not the capacity.
+*
+* @param table Pointer to the PairTable to clear.
+*/
+void pair_table_clear(PairTable *table) {
+    for (size_t i = 0; i < table->size; ++i) {
+        table->keys[table->order[i]] = PAIR_TABLE_EMPTY;
+    }
+    table->size = 0;
+}
+
+static size_t pair_table_probe(const PairTable *table, uint64_t key) {
+    size_t mask = table->capacity - 1;
+    size_t slot = hash_pair(key) & mask;
+    while (table->keys[slot] != PAIR_TABLE_EMPTY && table->keys[slot] != key) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static int pair_table_grow(PairTable *table) {
+    PairTable grown;
+    if (pair_table_alloc(&grown, table->capacity * 2, table->allocator) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < table->size; ++i) {
+        size_t old_slot = table->order[i];
+        size_t slot = pair_table_probe(&grown, table->keys[old_slot]);
+        grown.keys[slot] = table->keys[old_slot];
+        grown.values[slot] = table->values[old_slot];
+        grown.order[grown.size++] = slot;
+    }
+    pair_table_free(table);
+    *table = grown;
+    return 0;
+}
+
+/*
+* @brief Looks up a pair, inserting it with a value of 0 if it is missing.
+*
+* The table only grows once it is half full, so a table initialized for
+* the expected number of pairs never allocates here.
+*
+* @param table Pointer to the PairTable.
+* @param pair The pair to look up.
+* @return Pointer to the value stored for the pair, or NULL if growing the table fails.
+*/
+size_t* pair_table_get(PairTable *table, IntPair pair) {
+    uint64_t key = pack_pair(pair);
+    size_t slot = pair_table_probe(table, key);
+    if (table->keys[slot] == key) {
+        return &table->values[slot];
+    }
+    if (table->size + 1 > table->capacity / 2) {
+        if (pair_table_grow(table) != 0) {
+            return NULL;
+        }
+        slot = pair_table_probe(table, key);
+    }
+    table->keys[slot] = key;
+    table->values[slot] = 0;
+    table->order[table->size++] = slot;
+    return &table->values[slot];
+}
+
+/*
+* @brief Looks up a pair without inserting it.
+*
+* @param table Pointer to the PairTable.
+* @param pair The pair to look up.
+* @return Pointer to the value stored for the pair, or NULL if it is not present.
+*/
+const size_t* pair_table_find(const PairTable *table, IntPair pair) {
+    uint64_t key = pack_pair(pair);
+    size_t slot = pair_table_probe(table, key);
+    return table->keys[slot] == key ? &table->values[slot] : NULL;
+}
+
+/*
+* @brief Returns the i-th pair inserted into the table.
+*
+* @param table Pointer to the PairTable.
+* @param i Insertion index, in the range [0, table->size).
+* @return The pair stored at that position.
+*/
+IntPair pair_table_key(const PairTable *table, size_t i) {
+    return unpack_pair(table->keys[table->order[i]]);
+}
+
+/*
+* @brief Counts the frequencies of consecutive token pairs in the given ID sequence.
+*
+* Any previous contents of `pair_counts` are discarded. The table is owned by
+* the caller so it can be reused across calls without reallocating.
+*
+* @param ids Array of token IDs.
+* @param ids_size Number of token IDs in the array.
+* @param pair_counts Table that receives a count for every distinct pair, in order of first occurrence.
+* @return 0 on success, -1 if the table cannot grow; the counts are then incomplete.
+*/
+int token_counts(const int *ids, size_t ids_size, PairTable *pair_counts) {
+    pair_table_clear(pair_counts);
+    for (size_t i = 0; i + 1 < ids_size; ++i) {
+        IntPair pair = { ids[i], ids[i + 1] };
+        size_t *count = pair_table_get(pair_counts, pair);
+        if (!count) {
+            return -1;
+        }
+        (*count)++;
+    }
+    return 0;
+}
+
+typedef struct {
+    const int *ids;
+    size_t ids_size;
+    size_t chunk_size;
+    PairTable *chunk_counts;
+    int *statuses;      // one per chunk: 0, or -1 if its table could not grow
+} CountTask;
+
+static void count_chunk(void *context, size_t task, int worker) {
+    (void)worker;
+    const CountTask *count = (const CountTask*)context;
+    size_t start = task * count->chunk_size;
+    size_t end = start + count->chunk_size;
+    // Each chunk counts the pairs that start inside it, so the last pair reads
+    // one id past the chunk and no pair is lost or counted twice at a boundary.
+    if (end > count->ids_size - 1) {
+        end = count->ids_size - 1;
+    }
+    PairTable *counts = &count->chunk_counts[task];
+    pair_table_clear(counts);
+    count->statuses[task] = 0;
+    for (size_t i = start; i < end; ++i) {
+        size_t *value = pair_table_get(counts, (IntPair){ count->ids[i], count->ids[i + 1] });
+        if (!value) {
+            count->statuses[task] = -1;
+            return;
+        }
+        (*value)++;
+    }
+}
+
+/*
+* @brief Counts consecutive token pairs on a thread pool.
+*
+* The ids are split into one chunk per pool thread, each counted into its own
+* table, and the chunk tables are then summed in chunk order. Pairs end up in
+* `pair_counts` in order of first occurrence, exactly as token_counts() leaves
+* them, so ties are still broken the same way.
+*
+* @param ids Array of token IDs.
+* @param ids_size Number of token IDs in the array.
+* @param pair_counts Table that receives the total count of every distinct pair.
+* @param chunk_counts Scratch tables, one per thread in the pool.
+* @param pool Thread pool to count on, or NULL to count on the calling thread.
+* @return 0 on success, -1 if a table cannot grow; the counts are then incomplete.
+*/
+int token_counts_parallel(const int *ids, size_t ids_size, PairTable *pair_counts, PairTable *chunk_counts, ThreadPool *pool) {
+    int num_chunks = thread_pool_size(pool);
+    if (num_chunks == 1 || ids_size < 2) {
+        return token_counts(ids, ids_size, pair_counts);
+    }
+
+    int small[64];
+    int *statuses = num_chunks <= 64 ? small : (int*)mem_alloc(pair_counts->allocator, num_chunks * sizeof(int));
+    if (!statuses) {
+        return -1;
+    }
+    CountTask count = { ids, ids_size, (ids_size - 1 + num_chunks - 1) / num_chunks, chunk_counts, statuses };
+    thread_pool_run(pool, count_chunk, &count, num_chunks);
+
+    int status = 0;
+    pair_table_clear(pair_counts);
+    for (int c = 0; c < num_chunks && status == 0; ++c) {
+        const PairTable *counts = &chunk_counts[c];
+        status = statuses[c];
+        for (size_t j = 0; j < counts->size && status == 0; ++j) {
+            size_t slot = counts->order[j];
+            size_t *value = pair_table_get(pair_counts, unpack_pair(counts->keys[slot]));
+            if (!value) {
+                status = -1;
+            } else {
+                *value += counts->values[slot];
+            }
+        }
+    }
+    if (statuses != small) {
+        mem_free(pair_counts->allocator, statuses);
+    }
+    return status;
+}
+
+typedef struct {
+    int *ids;
+    size_t ids_size;
+    IntPair pair;
+    int idx;
+    int *scratch;
+    size_t chunk_size;
+    size_t *counts;     // two per chunk: output size when entered with carry 0 and 1
+    size_t *carries;    // two per chunk: whether the last match runs into the next chunk
+    size_t *offsets;    // two per chunk: resolved carry-in and output offset
+} MergeTask;
+
+// Advances the read cursor over one output token.
+static void merge_step(const MergeTask *m, size_t *r, size_t *count) {
+    if (*r + 1 < m->ids_size && m->ids[*r] == m->pair.first && m->ids[*r + 1] == m->pair.second) {
+        *r += 2;
+    } else {
+        *r += 1;
+    }
+    (*count)++;
+}
+
+static void merge_count_chunk(void *context, size_t task, int worker) {
+    (void)worker;
+    const MergeTask *m = (const MergeTask*)context;
+    size_t start = task * m->chunk_size;
+    size_t end = start + m->chunk_size < m->ids_size ? start + m->chunk_size : m->ids_size;
+
+    // Scan as if the first id is free (r0) and as if the previous chunk's last
+    // match consumed it (r1). Once both cursors land on the same id the rest
+    // of the chunk is identical, so it is only scanned once.
+    size_t r0 = start, r1 = start + 1, c0 = 0, c1 = 0;
+    while (r0 != r1 && (r0 < end || r1 < end)) {
+        if (r0 < r1) {
+            merge_step(m, &r0, &c0);
+        } else {
+            merge_step(m, &r1, &c1);
+        }
+    }
+    if (r0 == r1) {
+        size_t shared = 0;
+        while (r0 < end) {
+            merge_step(m, &r0, &shared);
+        }
+        r1 = r0;
+        c0 += shared;
+        c1 += shared;
+    }
+    m->counts[2 * task] = c0;
+    m->counts[2 * task + 1] = c1;
+    m->carries[2 * task] = r0 - end;
+    m->carries[2 * task + 1] = r1 - end;
+}
+
+static void merge_write_chunk(void *context, size_t task, int worker) {
+    (void)worker;
+    const MergeTask *m = (const MergeTask*)context;
+    size_t start = task * m->chunk_size;
+    size_t end = start + m->chunk_size < m->ids_size ? start + m->chunk_size : m->ids_size;
+    size_t carry = m->offsets[2 * task];
+    int *out = m->scratch + m->offsets[2 * task + 1];
+    for (size_t r = start + carry; r < end; ) {
+        if (r + 1 < m->ids_size && m->ids[r] == m->pair.first && m->ids[r + 1] == m->pair.second) {
+            *out++ = m->idx;
+            r += 2;
+        } else {
+            *out++ = m->ids[r++];
+        }
+    }
+}
+
+static void merge_copy_chunk(void *context, size_t task, int worker) {
+    (void)worker;
+    const MergeTask *m = (const MergeTask*)context;
+    size_t start = task * m->chunk_size;
+    size_t end = start + m->chunk_size < m->ids_size ? start + m->chunk_size : m->ids_size;
+    if (start < end) {
+        memcpy(m->ids + start, m->scratch + start, (end - start) * sizeof(int));
+    }
+}
+
+/*
+* @brief Applies a merge operation on a thread pool; the result matches merge().
+*
+* The ids are split into one chunk per thread. A first parallel pass works out,
+* for each chunk, how many ids it produces and whether its last match runs
+* into the next chunk, both for the case where the chunk's first id is free
+* and the case where the previous chunk already consumed it. A short serial
+* pass resolves the real case for every chunk from left to right and turns
+* the sizes into output offsets. A second parallel pass writes every chunk's
+* output at its offset in `scratch`, and a third copies it back.
+*
+* @param ids Array of token IDs to be merged.
+* @param ids_size Pointer to the size of the ids array (will be updated after merging).
+* @param pair The pair of tokens to be merged.
+* @param idx The new token ID to replace the merged pair.
+* @param scratch Buffer with room for *ids_size IDs; unused if the merge runs serially.
+* @param pool Thread pool to merge on, or NULL to merge on the calling thread.
+* @param allocator Memory functions for the per-chunk state of pools over 64 threads, or NULL
+*                  for the C library. If that allocation fails the merge runs serially.
+*/
+void merge_parallel(int *ids, size_t *ids_size, IntPair pair, int idx, int *scratch, ThreadPool *pool,
+                    const Allocator *allocator) {
+    size_t num_chunks = thread_pool_size(pool);
+    if (num_chunks == 1 || *ids_size < num_chunks * 64) {
+        merge(ids, ids_size, pair, idx);
+        return;
+    }
+
+    size_t state[6 * 64];
+    size_t *buffer = num_chunks <= 64 ? state : (size_t*)mem_alloc(allocator, 6 * num_chunks * sizeof(size_t));
+    if (!buffer) {
+        merge(ids, ids_size, pair, idx);
+        return;
+    }
+    MergeTask m = { ids, *ids_size, pair, idx, scratch, (*ids_size + num_chunks - 1) / num_chunks,
+                    buffer, buffer + 2 * num_chunks, buffer + 4 * num_chunks };
+    thread_pool_run(pool, merge_count_chunk, &m, num_chunks);
+
+    size_t carry = 0, total = 0;
+    for (size_t c = 0; c < num_chunks; ++c) {
+        m.offsets[2 * c] = carry;
+        m.offsets[2 * c + 1] = total;
+        total += m.counts[2 * c + carry];
+        carry = m.carries[2 * c + carry];
+    }
+
+    thread_pool_run(pool, merge_write_chunk, &m, num_chunks);
+    m.ids_size = total;
+    m.chunk_size = (total + num_chunks - 1) / num_chunks;
+    thread_pool_run(pool, merge_copy_chunk, &m, num_chunks);
+    *ids_size = total;
+
+    if (buffer != state) {
+        mem_free(allocator, buffer);
+    }
+}
+
+static void* thread_pool_worker(void *arg) {
+    ThreadPool *pool = ((ThreadWorker*)arg)->pool;
+    int worker = ((ThreadWorker*)arg)->index;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stopping && pool->next_task >= pool->num_tasks) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        if (pool->stopping) {
+            break;
+        }
+        size_t task = pool->next_task++;
+        pthread_mutex_unlock(&pool->lock);
+        pool->task(pool->context, task, worker);
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->done_tasks == pool->num_tasks) {
+            pthread_cond_signal(&pool->work_done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*
+* @brief Creates a thread pool.
+*
+* @param num_threads Total number of threads that run tasks, counting the caller of thread_pool_run().
+* @return A pointer to the new ThreadPool, or NULL if it could not be created.
+*/
+ThreadPool* create_thread_pool(int num_threads) {
+    ThreadPool *pool = (ThreadPool*)calloc(1, sizeof(ThreadPool));
+    if (!pool) {
+        return NULL;
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    pool->workers = (ThreadWorker*)malloc(num_threads * sizeof(ThreadWorker));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+    pool->num_threads = 1;
+    if (!pool->workers) {
+        destroy_thread_pool(pool);
+        return NULL;
+    }
+    for (int i = 1; i < num_threads; ++i) {
+        ThreadWorker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        if (pthread_create(&worker->thread, NULL, thread_pool_worker, worker) != 0) {
+            break;
+        }
+        pool->num_threads++;
+    }
+    return pool;
+}
+
+/*
+* @brief Stops the pool's threads and frees the pool.
+*
+* @param pool Pointer to the ThreadPool to be cleaned up.
+*/
+void destroy_thread_pool(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; i < pool->num_threads; ++i) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->work_done);
+    free(pool->workers);
+    free(pool);
+}
+
+/*
+* @brief Returns the number of threads that run tasks, 1 for a NULL pool.
+*/
+int thread_pool_size(const ThreadPool *pool) {
+    return pool ? pool->num_threads : 1;
+}
+
+/*
+* @brief Runs task(context, i, worker) for every i in [0, num_tasks) and waits for all of them.
+*
+* Tasks are handed out one at a time, so uneven tasks balance across threads.
+* `worker` identifies the running thread, in [0, thread_pool_size(pool)), so
+* tasks can use per-thread scratch. A NULL pool runs every task on the caller.
+*
+* @param pool Pointer to the ThreadPool, or NULL.
+* @param task Function to run for each task index.
+* @param context Pointer passed to every call.
+* @param num_tasks Number of tasks to run.
+*/
+void thread_pool_run(ThreadPool *pool, ThreadTask task, void *context, size_t num_tasks) {
+    if (!pool || pool->num_threads == 1) {
+        for (size_t i = 0; i < num_tasks; ++i) {
+            task(context, i, 0);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->context = context;
+    pool->num_tasks = num_tasks;
+    pool->next_task = 0;
+    pool->done_tasks = 0;
+    pthread_cond_broadcast(&pool->work_ready);
+    while (pool->next_task < pool->num_tasks) {
+        size_t i = pool->next_task++;
+        pthread_mutex_unlock(&pool->lock);
+        task(context, i, 0);
+        pthread_mutex_lock(&pool->lock);
+        pool->done_tasks++;
+    }
+    while (pool->done_tasks < pool->num_tasks) {
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/*
+* @brief Applies a merge operation to the given sequence of token IDs.
+*
+* The merge is done in place: the write cursor never passes the read
+* cursor because the output is never longer than the input.
+*
+* @param ids Array of token IDs to be merged.
+* @param ids_size Pointer to the size of the ids array (will be updated after merging).
+* @param pair The pair of tokens to be merged.
+* @param idx The new token ID to replace the merged pair.
+*/
+void merge(int *ids, size_t *ids_size, IntPair pair, int idx) {
+    size_t new_ids_size = 0;
+    for (size_t i = 0; i < *ids_size; ++i) {
+        if (ids[i] == pair.first && i + 1 < *ids_size && ids[i + 1] == pair.second) {
+            ids[new_ids_size++] = idx;
+            ++i;  // Skip the next element
+        } else {
+            ids[new_ids_size++] = ids[i];
+        }
+    }
+    *ids_size = new_ids_size;
+}
+
+/*
+* @brief Applies several merges to the given sequence of token IDs in one pass.
+*
+* The merges must not interact: no token may appear in more than one of the
+* pairs, and no new token ID may appear in any pair. The first condition
+* keeps matches from overlapping; the second keeps one merge from creating a
+* pair another merge would then combine, as (a, b) -> X followed by
+* (X, c) -> Y would. Under both, a single sweep gives the same result as
+* calling merge() once per pair, in any order.
+*
+* @param ids Array of token IDs to be merged.
+* @param ids_size Pointer to the size of the ids array (will be updated after merging).
+* @param merges Table mapping each pair to be merged to its new token ID.
+*/
+void merge_many(int *ids, size_t *ids_size, const PairTable *merges) {
+    size_t new_ids_size = 0;
+    for (size_t i = 0; i < *ids_size; ++i) {
+        const size_t *idx = NULL;
+        if (i + 1 < *ids_size) {
+            idx = pair_table_find(merges, (IntPair){ ids[i], ids[i + 1] });
+        }
+        if (idx) {
+            ids[new_ids_size++] = (int)*idx;
+            ++i;  // Skip the next element
+        } else {
+            ids[new_ids_size++] = ids[i];
+        }
+    }
+    *ids_size = new_ids_size;
+}
+
+
+#ifdef BPE_SELFTEST
+// Self-checks, built with -DBPE_SELFTEST: the fast paths are compared with
+// the simple serial and quadratic versions they must agree with, on
+// pseudo-random inputs from a fixed seed.
+
+static uint32_t selftest_state = 2463534242u;
+
+static uint32_t selftest_rand() {
+    selftest_state ^= selftest_state << 13;
+    selftest_state ^= selftest_state >> 17;
+    selftest_state ^= selftest_state << 5;
+    return selftest_state;
+}
+
+// Text from a small alphabet, so that pairs repeat and runs overlap.
+static size_t selftest_text(char *text, size_t capacity) {
+    static const char *const pieces[] = {
+        "a", "b", "aa", "ab", " ", "  ", "\n", "the", " the", "'s", "'ll", "7", "42", "1999", ",", "!?", "\xc3\xa9",
+        "\xe4\xb8\xad", "\xe0\xae\xa4\xe0\xae\xae", "\xf0\x9f\x99\x82", "\t", "\r\n"
+    };
+    size_t size = 0;
+    size_t target = selftest_rand() % capacity;
+    while (size < target) {
+        const char *piece = pieces[selftest_rand() % (sizeof(pieces) / sizeof(pieces[0]))];
+        size_t length = strlen(piece);
+        if (size + length > capacity) {
+            break;
+        }
+        memcpy(text + size, piece, length);
+        size += length;
+    }
+    return size;
+}
+
+static int selftest_same(const int *a, size_t a_size, const int *b, size_t b_size) {
+    return a_size == b_size && (a_size == 0 || memcmp(a, b, a_size * sizeof(int)) == 0);
+}
+
+// merge_parallel() against merge(), on sizes around the chunk boundaries and pairs like (a, a).
+static int selftest_merge_parallel(ThreadPool *pool) {
+    int failures = 0;
+    int *expected = (int*)malloc(5000 * sizeof(int));
+    int *ids = (int*)malloc(5000 * sizeof(int));
+    int *scratch = (int*)malloc(5000 * sizeof(int));
+    for (int round = 0; round < 2000; ++round) {
+        size_t size = round < 100 ? (size_t)round : selftest_rand() % 5000;
+        int alphabet = 1 + selftest_rand() % 4;
+        for (size_t i = 0; i < size; ++i) {
+            expected[i] = ids[i] = selftest_rand() % alphabet;
+        }
+        IntPair pair = { (int)(selftest_rand() % alphabet), (int)(selftest_rand() % alphabet) };
+        size_t expected_size = size, ids_size = size;
+        merge(expected, &expected_size, pair, 9);
+        merge_parallel(ids, &ids_size, pair, 9, scratch, pool, NULL);
+        failures += !selftest_same(expected, expected_size, ids, ids_size);
+    }
+    free(expected);
+    free(ids);
+    free(scratch);
+    return failures;
+}
+
+// merge_many() against one merge() per pair, with pairs that share no token and no new id.
+static int selftest_merge_many() {
+    int failures = 0;
+    int expected[64], ids[64];
+    for (int round = 0; round < 2000; ++round) {
+        int tokens[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+        for (int i = 7; i > 0; --i) {
+            int j = selftest_rand() % (i + 1);
+            int t = tokens[i];
+            tokens[i] = tokens[j];
+            tokens[j] = t;
+        }
+        size_t size = selftest_rand() % 64;
+        for (size_t i = 0; i < size; ++i) {
+            expected[i] = ids[i] = selftest_rand() % 8;
+        }
+        PairTable merges;
+        pair_table_init(&merges, 4);
+        size_t expected_size = size, ids_size = size;
+        for (int m = 0, count = selftest_rand() % 5; m < count; ++m) {
+            IntPair pair = { tokens[2 * m], tokens[2 * m + 1] };
+            *pair_table_get(&merges, pair) = 100 + m;
+            merge(expected, &expected_size, pair, 100 + m);
+        }
+        merge_many(ids, &ids_size, &merges);
+        failures += !selftest_same(expected, expected_size, ids, ids_size);
+        pair_table_free(&merges);
+    }
+    return failures;
+}
+
+// Allocator that refuses only its call number `fail_at`, and counts live
+// blocks so that leaks show up. Locked, as pool threads allocate too.
+typedef struct {
+    pthread_mutex_t lock;
+    size_t fail_at;
+    size_t calls;
+    size_t refused;
+    long live;
+} SelftestFaults;
+
+static void* selftest_faults_realloc(void *user, void *data, size_t size) {
+    SelftestFaults *faults = (SelftestFaults*)user;
+    pthread_mutex_lock(&faults->lock);
+    int refuse = faults->calls++ == faults->fail_at;
+    faults->refused += refuse;
+    faults->live += !refuse && !data;
+    pthread_mutex_unlock(&faults->lock);
+    return refuse ? NULL : realloc(data, size);
+}
+
+static void* selftest_faults_alloc(void *user, size_t size) {
+    return selftest_faults_realloc(user, NULL, size);
+}
+
+static void selftest_faults_free(void *user, void *data) {
+    SelftestFaults *faults = (SelftestFaults*)user;
+    pthread_mutex_lock(&faults->lock);
+    faults->live--;
+    pthread_mutex_unlock(&faults->lock);
+    free(data);
+}
+
+typedef int (*SelftestRun)(const Allocator *allocator, void *context);
+
+// Runs `run` once for every allocation it makes, failing that one allocation,
+// and counts its failures plus the runs that leak.
+static int selftest_fault_sweep(SelftestRun run, void *context) {
+    SelftestFaults faults = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0 };
+    Allocator allocator = { selftest_faults_alloc, selftest_faults_realloc, selftest_faults_free, &faults };
+    int failures = 0;
+    for (size_t fail_at = 0; ; ++fail_at) {
+        faults.fail_at = fail_at;
+        faults.calls = faults.refused = 0;
+        faults.live = 0;
+        failures += run(&allocator, context);
+        failures += faults.live != 0;
+        if (faults.refused == 0) {
+            return failures;
+        }
+    }
+}
+
+// Checks one step of a run under selftest_fault_sweep(): a step that succeeds
+// must give the expected result, and one that fails must have been refused
+// memory since the previous step.
+static int selftest_outcome(const Allocator *allocator, size_t *refused, int status, int same) {
+    size_t now = ((const SelftestFaults*)allocator->user)->refused;
+    int failed = status == 0 ? !same : now == *refused;
+    *refused = now;
+    return failed;
+}
+
+typedef struct {
+    const char *text;
+    size_t size;
+    ThreadPool *pool;
+    const BasicTokenizer *reference;
+} SelftestTraining;
+
+static int selftest_same_merges(const BasicTokenizer *a, const BasicTokenizer *b) {
+    return a->num_merges == b->num_merges && memcmp(a->merges, b->merges, a->num_merges * sizeof(Merge)) == 0;
+}
+
+static int selftest_train_run(const Allocator *allocator, void *context) {
+    const SelftestTraining *training = (const SelftestTraining*)context;
+    const BasicTokenizer *reference = training->reference;
+    size_t refused = 0;
+    BasicTokenizer *tokenizer = create_tokenizer_with_allocator(allocator);
+    if (!tokenizer) {
+        return selftest_outcome(allocator, &refused, -1, 0);
+    }
+    set_split_pattern(tokenizer, reference->split_pattern);
+    int status = train_parallel(tokenizer, training->text, training->size, reference->vocab_size, training->pool, 0);
+    int failures = selftest_outcome(allocator, &refused, status, selftest_same_merges(tokenizer, reference));
+    clean_tokenizer(tokenizer);
+    return failures;
+}
+
+// Training that runs out of memory must fail, never learn different merges.
+static int selftest_train_faults(const char *text, size_t size, size_t vocab_size, SplitPattern pattern, ThreadPool *pool) {
+    BasicTokenizer *reference = create_tokenizer();
+    set_split_pattern(reference, pattern);
+    int failures = train_parallel(reference, text, size, vocab_size, pool, 0) != 0;
+    SelftestTraining training = { text, size, pool, reference };
+    failures += selftest_fault_sweep(selftest_train_run, &training);
+    clean_tokenizer(reference);
+    return failures;
+}
+
+// Training needs a vocab of at least 256 and a tokenizer that no merge or special token has used yet.
+static int selftest_train_rejects(ThreadPool *pool) {
+    char text[3000];
+    size_t size = selftest_text(text, sizeof(text));
+    int failures = 0;
+    for (int pattern = SPLIT_NONE; pattern <= SPLIT_GPT4; ++pattern) {
+        BasicTokenizer *tokenizer = create_tokenizer();
+        set_split_pattern(tokenizer, (SplitPattern)pattern);
+        failures += train_bytes(tokenizer, text, size, 255, 0) != -1;
+        failures += train_incremental(tokenizer, text, size, 0, 0) != -1;
+        failures += tokenizer->num_merges != 0;
+        failures += train_bytes(tokenizer, text, size, 256, 0) != 0;
+        failures += train_parallel(tokenizer, text, size, 300, pool, 0) != 0;
+
+        // A second training would number its merges from 256 again.
+        size_t num_merges = tokenizer->num_merges;
+        Merge merges[44];
+        memcpy(merges, tokenizer->merges, num_merges * sizeof(Merge));
+        failures += train_bytes(tokenizer, text, size, 400, 0) != -1;
+        failures += train_parallel(tokenizer, text, size, 400, pool, 0) != -1;
+        failures += train_incremental(tokenizer, text, size, 400, 0) != -1;
+        failures += train_words(tokenizer, text, size, 400, 0) != -1;
+        failures += tokenizer->num_merges != num_merges || memcmp(tokenizer->merges, merges, num_merges * sizeof(Merge)) != 0;
+        clean_tokenizer(tokenizer);
+
+        tokenizer = create_tokenizer();
+        set_split_pattern(tokenizer, (SplitPattern)pattern);
+        add_special_token(tokenizer, "<|end|>", 280);
+        failures += train_incremental(tokenizer, text, size, 281, 0) != -1;
+        failures += train_incremental(tokenizer, text, size, 280, 0) != 0;
+        clean_tokenizer(tokenizer);
+    }
+    return failures;
+}
+
+typedef struct {
+    const int *ids;
+    size_t size;
+    ThreadPool *pool;
+    const PairTable *reference;
+} SelftestCounting;
+
+static int selftest_count_run(const Allocator *allocator, void *context) {
+    const SelftestCounting *counting = (const SelftestCounting*)context;
+    int num_tables = thread_pool_size(counting->pool);
+    PairTable tables[5];        // the total, then one per thread of a pool of at most 4
+    size_t refused = 0;
+    int status = 0;
+    for (int t = 0; t <= num_tables; ++t) {
+        status |= pair_table_init_with_allocator(&tables[t], 1, allocator);
+    }
+    int failures = selftest_outcome(allocator, &refused, status, 1);
+    if (status == 0) {
+        status = token_counts_parallel(counting->ids, counting->size, &tables[0], tables + 1, counting->pool);
+        int same = tables[0].size == counting->reference->size;
+        for (size_t j = 0; same && j < tables[0].size; ++j) {
+            const size_t *count = pair_table_find(counting->reference, pair_table_key(&tables[0], j));
+            same = count && *count == tables[0].values[tables[0].order[j]];
+        }
+        failures += selftest_outcome(allocator, &refused, status, same);
+    }
+    for (int t = 0; t <= num_tables; ++t) {
+        pair_table_free(&tables[t]);
+    }
+    return failures;
+}
+
+// Counting that runs out of memory must fail, never give partial counts.
+static int selftest_count_faults(ThreadPool *pool) {
+    size_t size = 20000;
+    int *ids = (int*)malloc(size * sizeof(int));
+    for (size_t i = 0; i < size; ++i) {
+        ids[i] = selftest_rand() % 300;
+    }
+    PairTable reference;
+    pair_table_init(&reference, size);
+    int failures = token_counts(ids, size, &reference) != 0;
+    SelftestCounting counting = { ids, size, pool, &reference };
+    failures += selftest_fault_sweep(selftest_count_run, &counting);
+    pair_table_free(&reference);
+    free(ids);
+    return failures;
+}
+
+// Running out of memory while counting or training must be reported, never turn into wrong merges.
+static int selftest_train_out_of_memory(ThreadPool *pool) {
+    int failures = selftest_count_faults(NULL) + selftest_count_faults(pool);
+    char *text = (char*)malloc(3000);
+    for (int pattern = SPLIT_NONE; pattern <= SPLIT_GPT4; ++pattern) {
+        size_t size = selftest_text(text, 3000);
+        failures += selftest_train_faults(text, size, 300, (SplitPattern)pattern, NULL);
+        failures += selftest_train_faults(text, size, 300, (SplitPattern)pattern, pool);
+    }
+    free(text);
+    return failures;
+}
+
+// The quadratic trainer, as in minbpe: split the documents into chunks, count
+// every pair, merge the most frequent, repeat. Ties go to the pair seen first.
+// Chunks are separated by -1, which no pair may use.
+static void selftest_train_reference(SplitPattern pattern, const char *const *docs, const size_t *sizes, size_t num_docs,
+                                     size_t vocab_size, Merge *merges, size_t *num_merges) {
+    size_t total = 0;
+    for (size_t d = 0; d < num_docs; ++d) {
+        total += sizes[d];
+    }
+    int *ids = (int*)malloc((2 * total + num_docs + 1) * sizeof(int));
+    size_t ids_size = 0;
+    for (size_t d = 0; d < num_docs; ++d) {
+        const unsigned char *bytes = (const unsigned char*)docs[d];
+        for (size_t pos = 0; pos < sizes[d]; ) {
+            size_t length = pattern == SPLIT_NONE ? sizes[d] : split_chunk(pattern, bytes + pos, sizes[d] - pos);
+            for (size_t i = 0; i < length; ++i) {
+                ids[ids_size++] = bytes[pos + i];
+            }
+            ids[ids_size++] = -1;
+            pos += length;
+        }
+    }
+    PairTable counts;
+    pair_table_init(&counts, ids_size);
+    *num_merges = 0;
+    for (size_t idx = INITIAL_VOCAB_SIZE; idx < vocab_size; ++idx) {
+        token_counts(ids, ids_size, &counts);
+        size_t best = 0;
+        IntPair pair = { 0, 0 };
+        for (size_t j = 0; j < counts.size; ++j) {
+            IntPair candidate = pair_table_key(&counts, j);
+            if (candidate.first >= 0 && candidate.second >= 0 && counts.values[counts.order[j]] > best) {
+                best = counts.values[counts.order[j]];
+                pair = candidate;
+            }
+        }
+        if (best == 0) {
+            break;
+        }
+        merge(ids, &ids_size, pair, (int)idx);
+        merges[(*num_merges)++] = (Merge){ pair, (int)idx };
+    }
+    pair_table_free(&counts);
+    free(ids);
+}
+
+// The quadratic encoder: within each chunk, merge the lowest-ranked pair until none has a rank.
+static void selftest_encode_reference(const BasicTokenizer *tokenizer, const char *text, size_t size,
+                                      int *ids, size_t *ids_size) {
+    const unsigned char *bytes = (const unsigned char*)text;
+    size_t n = 0;
+    for (size_t pos = 0; pos < size; ) {
+        size_t length = tokenizer->split_pattern == SPLIT_NONE ? size : split_chunk(tokenizer->split_pattern, bytes + pos, size - pos);
+        int *chunk = ids + n;
+        size_t chunk_size = length;
+        for (size_t i = 0; i < length; ++i) {
+            chunk[i] = bytes[pos + i];
+        }
+        for (;;) {
+            size_t best = tokenizer->num_merges;
+            for (size_t i = 0; i + 1 < chunk_size; ++i) {
+                size_t rank = merge_rank(tokenizer, (IntPair){ chunk[i], chunk[i + 1] });
+                if (rank < best) {
+                    best = rank;
+                }
+            }
+            if (best == tokenizer->num_merges) {
+                break;
+            }
+            merge(chunk, &chunk_size, tokenizer->merges[best].pair, tokenizer->merges[best].idx);
+        }
+        n += chunk_size;
+        pos += length;
+    }
+    *ids_size = n;
+}
+
+typedef struct {
+    int *ids;
+    size_t size;
+} SelftestSink;
+
+static void selftest_sink(void *user, const int *ids, size_t ids_size) {
+    SelftestSink *sink = (SelftestSink*)user;
+    memcpy(sink->ids + sink->size, ids, ids_size * sizeof(int));
+    sink->size += ids_size;
+}
+
+// Every trainer against the quadratic one, and every encoder against the quadratic one.
+static int selftest_train_and_encode(ThreadPool *pool) {
+    enum { CAPACITY = 3000, VOCAB = 330 };
+    int failures = 0;
+    char *text = (char*)malloc(CAPACITY);
+    int *expected = (int*)malloc(CAPACITY * sizeof(int));
+    int *ids = (int*)malloc(CAPACITY * sizeof(int));
+    uint16_t *compact = (uint16_t*)malloc(CAPACITY * sizeof(uint16_t));
+    Merge merges[VOCAB];
+    for (int round = 0; round < 60; ++round) {
+        size_t size = selftest_text(text, CAPACITY);
+        SplitPattern pattern = (SplitPattern)(round % 3);
+        BasicTokenizer *serial = create_tokenizer();
+        BasicTokenizer *parallel = create_tokenizer();
+        BasicTokenizer *incremental = create_tokenizer();
+        set_split_pattern(serial, pattern);
+        set_split_pattern(parallel, pattern);
+        set_split_pattern(incremental, pattern);
+        train_bytes(serial, text, size, VOCAB, 0);
+        train_parallel(parallel, text, size, VOCAB, pool, 0);
+        train_incremental(incremental, text, size, VOCAB, 0);
+
+        size_t num_merges;
+        selftest_train_reference(pattern, (const char *const*)&text, &size, 1, VOCAB, merges, &num_merges);
+        const BasicTokenizer *trained[] = { serial, parallel, incremental };
+        for (int t = 0; t < 3; ++t) {
+            failures += trained[t]->num_merges != num_merges ||
+                        memcmp(trained[t]->merges, merges, num_merges * sizeof(Merge)) != 0;
+        }
+
+        // Encode a different text than the one trained on.
+        size = selftest_text(text, CAPACITY);
+        size_t expected_size, ids_size;
+        selftest_encode_reference(serial, text, size, expected, &expected_size);
+        failures += encode_bytes(serial, text, size, ids, &ids_size) != 0 ||
+                    !selftest_same(expected, expected_size, ids, ids_size);
+
+        EncodeWorkspace *workspace = create_encode_workspace();
+        set_encode_cache_size(workspace, 3);
+        for (int pass = 0; pass < 2; ++pass) {
+            failures += encode_with_workspace(serial, text, size, ids, &ids_size, workspace) != 0 ||
+                        !selftest_same(expected, expected_size, ids, ids_size);
+        }
+        clean_encode_workspace(workspace);
+
+        failures += encode_u16(serial, text, size, compact, &ids_size) != 0 || ids_size != expected_size;
+        for (size_t i = 0; i < ids_size && i < expected_size; ++i) {
+            failures += compact[i] != expected[i];
+        }
+
+        StreamEncoder *encoder = create_stream_encoder(serial);
+        SelftestSink sink = { ids, 0 };
+        for (size_t pos = 0; pos < size; ) {
+            size_t piece = 1 + selftest_rand() % 16;
+            piece = piece < size - pos ? piece : size - pos;
+            stream_encoder_push(encoder, text + pos, piece, selftest_sink, &sink);
+            pos += piece;
+        }
+        stream_encoder_finish(encoder, selftest_sink, &sink);
+        clean_stream_encoder(encoder);
+        failures += !selftest_same(expected, expected_size, sink.ids, sink.size);
+
+        clean_tokenizer(serial);
+        clean_tokenizer(parallel);
+        clean_tokenizer(incremental);
+    }
+    free(text);
+    free(expected);
+    free(ids);
+    free(compact);
+    return failures;
+}
+
+typedef struct {
+    const char *text;
+    size_t size;
+    const char *special_text;
+    size_t special_size;
+    const int *ids;             // text encoded by the reference tokenizer
+    size_t ids_size;
+    const int *special_ids;     // special_text encoded with SPECIAL_ALL
+    size_t special_ids_size;
+    ThreadPool *pool;
+    const BasicTokenizer *reference;
+} SelftestScenario;
+
+// Trains, registers a special token and encodes every way there is, all with one allocator.
+static int selftest_scenario_run(const Allocator *allocator, void *context) {
+    const SelftestScenario *scenario = (const SelftestScenario*)context;
+    size_t refused = 0;
+    BasicTokenizer *tokenizer = create_tokenizer_with_allocator(allocator);
+    if (!tokenizer) {
+        return selftest_outcome(allocator, &refused, -1, 0);
+    }
+    set_split_pattern(tokenizer, scenario->reference->split_pattern);
+    int status = train_bytes(tokenizer, scenario->text, scenario->size, scenario->reference->vocab_size, 0);
+    int failures = selftest_outcome(allocator, &refused, status, selftest_same_merges(tokenizer, scenario->reference));
+    if (status == 0) {
+        status = add_special_token(tokenizer, "<|end|>", 1000);
+        failures += selftest_outcome(allocator, &refused, status, 1);
+    }
+    if (status != 0) {
+        clean_tokenizer(tokenizer);
+        return failures;
+    }
+
+    int *ids = (int*)malloc(2 * (scenario->size + scenario->special_size) * sizeof(int));
+    size_t ids_size;
+    status = encode_special(tokenizer, scenario->special_text, scenario->special_size, SPECIAL_ALL, NULL, 0, ids, &ids_size);
+    failures += selftest_outcome(allocator, &refused, status,
+                                 selftest_same(ids, ids_size, scenario->special_ids, scenario->special_ids_size));
+    status = encode_bytes(tokenizer, scenario->text, scenario->size, ids, &ids_size);
+    failures += selftest_outcome(allocator, &refused, status, selftest_same(ids, ids_size, scenario->ids, scenario->ids_size));
+
+    EncodeWorkspace *workspace = create_encode_workspace_with_allocator(allocator);
+    failures += selftest_outcome(allocator, &refused, workspace ? 0 : -1, 1);
+    for (int pass = 0; workspace && pass < 2; ++pass) {
+        status = encode_with_workspace(tokenizer, scenario->text, scenario->size, ids, &ids_size, workspace);
+        failures += selftest_outcome(allocator, &refused, status, selftest_same(ids, ids_size, scenario->ids, scenario->ids_size));
+    }
+    if (workspace) {
+        clean_encode_workspace(workspace);
+    }
+
+    StreamEncoder *encoder = create_stream_encoder(tokenizer);
+    failures += selftest_outcome(allocator, &refused, encoder ? 0 : -1, 1);
+    if (encoder) {
+        SelftestSink sink = { ids, 0 };
+        status = 0;
+        for (size_t pos = 0; pos < scenario->size && status == 0; pos += 100) {
+            size_t piece = scenario->size - pos < 100 ? scenario->size - pos : 100;
+            status = stream_encoder_push(encoder, scenario->text + pos, piece, selftest_sink, &sink);
+        }
+        status = status == 0 ? stream_encoder_finish(encoder, selftest_sink, &sink) : -1;
+        failures += selftest_outcome(allocator, &refused, status,
+                                     selftest_same(sink.ids, sink.size, scenario->ids, scenario->ids_size));
+        clean_stream_encoder(encoder);
+    }
+
+    const char *docs[2] = { scenario->text, scenario->text };
+    size_t doc_sizes[2] = { scenario->size, scenario->size }, offsets[3];
+    status = encode_batch(tokenizer, docs, doc_sizes, 2, ids, offsets, scenario->pool);
+    failures += selftest_outcome(allocator, &refused, status,
+                                 offsets[1] == scenario->ids_size && offsets[2] == 2 * scenario->ids_size &&
+                                 selftest_same(ids, offsets[1], scenario->ids, scenario->ids_size) &&
+                                 selftest_same(ids + offsets[1], offsets[1], scenario->ids, scenario->ids_size));
+    free(ids);
+    clean_tokenizer(tokenizer);
+    return failures;
+}
+
+// merge_parallel() on a pool too large for its on-stack state must use the given allocator.
+static int selftest_merge_parallel_allocator() {
+    ThreadPool *pool = create_thread_pool(65);
+    size_t size = 65 * 64 * 4;
+    int *expected = (int*)malloc(size * sizeof(int));
+    int *ids = (int*)malloc(size * sizeof(int));
+    int *scratch = (int*)malloc(size * sizeof(int));
+    int failures = 0;
+    for (int fail = 0; fail < 2; ++fail) {
+        for (size_t i = 0; i < size; ++i) {
+            expected[i] = ids[i] = selftest_rand() % 3;
+        }
+        SelftestFaults faults = { PTHREAD_MUTEX_INITIALIZER, fail ? 0 : SIZE_MAX, 0, 0, 0 };
+        Allocator allocator = { selftest_faults_alloc, selftest_faults_realloc, selftest_faults_free, &faults };
+        size_t expected_size = size, ids_size = size;
+        merge(expected, &expected_size, (IntPair){ 1, 2 }, 7);
+        merge_parallel(ids, &ids_size, (IntPair){ 1, 2 }, 7, scratch, pool, &allocator);
+        // When its state cannot be allocated, the merge runs serially.
+        failures += !selftest_same(expected, expected_size, ids, ids_size) || faults.calls != 1 || faults.live != 0;
+    }
+    free(expected);
+    free(ids);
+    free(scratch);
+    destroy_thread_pool(pool);
+    return failures;
+}
+
+// Everything a tokenizer allocates goes through its allocator, and running out
+// of memory anywhere is reported without leaking or giving wrong ids.
+static int selftest_allocator(ThreadPool *pool) {
+    char text[3000], special_text[3100];
+    size_t size = selftest_text(text, sizeof(text));
+    memcpy(special_text, text, size / 2);
+    memcpy(special_text + size / 2, "<|end|>", 7);
+    memcpy(special_text + size / 2 + 7, text + size / 2, size - size / 2);
+    size_t special_size = size + 7;
+
+    BasicTokenizer *reference = create_tokenizer();
+    set_split_pattern(reference, SPLIT_GPT4);
+    int failures = train_bytes(reference, text, size, 300, 0) != 0 || add_special_token(reference, "<|end|>", 1000) != 0;
+    int *ids = (int*)malloc(size * sizeof(int));
+    int *special_ids = (int*)malloc(special_size * sizeof(int));
+    size_t ids_size, special_ids_size;
+    failures += encode_bytes(reference, text, size, ids, &ids_size) != 0;
+    failures += encode_special(reference, special_text, special_size, SPECIAL_ALL, NULL, 0, special_ids, &special_ids_size) != 0;
+
+    SelftestScenario scenario = { text, size, special_text, special_size, ids, ids_size, special_ids, special_ids_size,
+                                  pool, reference };
+    failures += selftest_fault_sweep(selftest_scenario_run, &scenario);
+    failures += selftest_merge_parallel_allocator();
+    free(ids);
+    free(special_ids);
+    clean_tokenizer(reference);
+    return failures;
+}
+
+// encode_batch() gives every document the ids encode_bytes() gives it, and refuses special tokens as it does.
+static int selftest_encode_batch(ThreadPool *pool) {
+    enum { DOCS = 40, DOC_CAPACITY = 500 };
+    char *text = (char*)malloc(DOCS * DOC_CAPACITY);
+    const char *docs[DOCS];
+    size_t doc_sizes[DOCS], offsets[DOCS + 1], total = 0;
+    for (int d = 0; d < DOCS; ++d) {
+        docs[d] = text + total;
+        doc_sizes[d] = selftest_text(text + total, DOC_CAPACITY);
+        total += doc_sizes[d];
+    }
+    int *ids = (int*)malloc((total + 1) * sizeof(int));
+    int *expected = (int*)malloc(DOC_CAPACITY * sizeof(int));
+    int failures = 0;
+    for (int pattern = SPLIT_NONE; pattern <= SPLIT_GPT4; ++pattern) {
+        BasicTokenizer *tokenizer = create_tokenizer();
+        set_split_pattern(tokenizer, (SplitPattern)pattern);
+        failures += train_bytes(tokenizer, text, total, 350, 0) != 0;
+        add_special_token(tokenizer, "!?", 1000);
+        for (int p = 0; p < 2; ++p) {
+            int status = encode_batch(tokenizer, docs, doc_sizes, DOCS, ids, offsets, p ? pool : NULL);
+            int any_special = 0;
+            for (int d = 0; d < DOCS; ++d) {
+                size_t expected_size;
+                int special = encode_bytes(tokenizer, docs[d], doc_sizes[d], expected, &expected_size) != 0;
+                any_special |= special;
+                failures += !selftest_same(expected, special ? 0 : expected_size, ids + offsets[d], offsets[d + 1] - offsets[d]);
+            }
+            failures += status != (any_special ? -1 : 0);
+        }
+        clean_tokenizer(tokenizer);
+    }
+    free(text);
+    free(ids);
+    free(expected);
+    return failures;
+}
+
+// train_files() trains on a directory's files in name order as separate documents, never merging across two.
+static int selftest_train_files() {
+    enum { DOCS = 12, DOC_CAPACITY = 300, VOCAB = 320 };
+    char dir[] = "/tmp/minbpe-selftest-XXXXXX";
+    if (!mkdtemp(dir)) {
+        return 1;
+    }
+    char *text = (char*)malloc(DOCS * DOC_CAPACITY);
+    const char *docs[DOCS];
+    size_t sizes[DOCS];
+    char paths[DOCS][64];
+    int failures = 0;
+    for (int d = 0; d < DOCS; ++d) {
+        // Every file runs from 'Z' to 'Q', so ("Q", "Z") would be a frequent pair if files were
+        // joined. The third file is empty, which must not join its neighbours either.
+        char *doc = text + d * DOC_CAPACITY;
+        docs[d] = doc;
+        sizes[d] = 0;
+        if (d != 2) {
+            doc[0] = 'Z';
+            sizes[d] = selftest_text(doc + 1, DOC_CAPACITY - 2) + 2;
+            doc[sizes[d] - 1] = 'Q';
+        }
+        snprintf(paths[d], sizeof(paths[d]), "%s/%c", dir, 'z' - d);
+        FILE *file = fopen(paths[d], "wb");
+        failures += !file || fwrite(docs[d], 1, sizes[d], file) != sizes[d];
+        if (file) {
+            fclose(file);
+        }
+    }
+    // Name order is the reverse of creation order.
+    const char *ordered[DOCS];
+    size_t ordered_sizes[DOCS];
+    for (int d = 0; d < DOCS; ++d) {
+        ordered[d] = docs[DOCS - 1 - d];
+        ordered_sizes[d] = sizes[DOCS - 1 - d];
+    }
+
+    Merge merges[VOCAB];
+    for (int pattern = SPLIT_NONE; pattern <= SPLIT_GPT4; ++pattern) {
+        size_t num_merges;
+        selftest_train_reference((SplitPattern)pattern, ordered, ordered_sizes, DOCS, VOCAB, merges, &num_merges);
+        BasicTokenizer *tokenizer = create_tokenizer();
+        set_split_pattern(tokenizer, (SplitPattern)pattern);
+        const char *corpus = dir;
+        failures += train_files(tokenizer, &corpus, 1, VOCAB, 0) != 0 ||
+                    tokenizer->num_merges != num_merges ||
+                    memcmp(tokenizer->merges, merges, num_merges * sizeof(Merge)) != 0;
+        clean_tokenizer(tokenizer);
+    }
+
+    // A missing path fails without training.
+    BasicTokenizer *tokenizer = create_tokenizer();
+    const char *missing[] = { paths[0], "/nonexistent/minbpe-selftest" };
+    failures += train_files(tokenizer, missing, 2, VOCAB, 0) != -1 || tokenizer->num_merges != 0;
+    clean_tokenizer(tokenizer);
+
+    for (int d = 0; d < DOCS; ++d) {
+        unlink(paths[d]);
+    }
+    rmdir(dir);
+    free(text);
+    return failures;
+}
+
+// decode() and decode_bytes() report the full length, write only what fits, and never touch the rest.
+static int selftest_decode() {
+    enum { CAPACITY = 600 };
+    char text[CAPACITY], out[CAPACITY + 16];
+    size_t size = selftest_text(text, CAPACITY - 8);
+    BasicTokenizer *tokenizer = create_tokenizer();
+    int failures = train_bytes(tokenizer, text, size, 320, 0) != 0;
+    failures += add_special_token(tokenizer, "<|end|>", 1000) != 0;
+    int ids[CAPACITY];
+    size_t ids_size;
+    failures += encode_bytes(tokenizer, text, size, ids, &ids_size) != 0;
+    // Unknown ids decode to nothing; special tokens to their string.
+    ids[ids_size++] = 999;
+    ids[ids_size++] = 1000;
+    memcpy(text + size, "<|end|>", 7);
+    size += 7;
+
+    failures += decode_bytes(tokenizer, ids, ids_size, NULL, 0) != size;
+    failures += decode(tokenizer, ids, ids_size, NULL, 0) != size;
+    for (size_t capacity = 0; capacity <= size + 4; ++capacity) {
+        memset(out, '#', sizeof(out));
+        size_t written = capacity < size ? capacity : size;
+        failures += decode_bytes(tokenizer, ids, ids_size, out, capacity) != size ||
+                    memcmp(out, text, written) != 0 || out[written] != '#';
+
+        memset(out, '#', sizeof(out));
+        written = capacity == 0 ? 0 : (capacity - 1 < size ? capacity - 1 : size);
+        failures += decode(tokenizer, ids, ids_size, out, capacity) != size ||
+                    memcmp(out, text, written) != 0 ||
+                    (capacity > 0 && out[written] != '\0') || out[written + (capacity > 0)] != '#';
+    }
+    clean_tokenizer(tokenizer);
+    return failures;
+}
+
+// Two tokenizers agree on their merges, vocab, pattern and special tokens, and encode and decode `text` alike.
+static int selftest_same_tokenizer(const BasicTokenizer *a, const BasicTokenizer *b, const char *text, size_t size) {
+    int same = a->num_merges == b->num_merges && a->vocab_size == b->vocab_size &&
+               a->split_pattern == b->split_pattern && a->specials.size == b->specials.size &&
+               memcmp(a->merges, b->merges, a->num_merges * sizeof(Merge)) == 0;
+    for (size_t id = 0; same && id < a->vocab_size; ++id) {
+        size_t a_length, b_length;
+        const unsigned char *a_bytes = token_bytes(a, (int)id, &a_length);
+        const unsigned char *b_bytes = token_bytes(b, (int)id, &b_length);
+        same = a_length == b_length && memcmp(a_bytes, b_bytes, a_length) == 0;
+    }
+    int *a_ids = (int*)malloc((size + 1) * sizeof(int));
+    int *b_ids = (int*)malloc((size + 1) * sizeof(int));
+    char *decoded = (char*)malloc(size + 1);
+    size_t a_size = 0, b_size = 0;
+    same = same && encode_special(a, text, size, SPECIAL_ALL, NULL, 0, a_ids, &a_size) == 0 &&
+           encode_special(b, text, size, SPECIAL_ALL, NULL, 0, b_ids, &b_size) == 0 &&
+           selftest_same(a_ids, a_size, b_ids, b_size) &&
+           decode_bytes(b, b_ids, b_size, decoded, size) == size && memcmp(decoded, text, size) == 0;
+    free(a_ids);
+    free(b_ids);
+    free(decoded);
+    return same;
+}
+
+static int selftest_write_file(const char *path, const void *data, size_t size) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return -1;
+    }
+    int status = fwrite(data, 1, size, file) == size ? 0 : -1;
+    return fclose(file) == 0 ? status : -1;
+}
+
+// save_tokenizer() and load_tokenizer() round-trip a tokenizer, and a corrupt or truncated file is refused.
+static int selftest_save_load() {
+    char dir[] = "/tmp/minbpe-selftest-XXXXXX";
+    if (!mkdtemp(dir)) {
+        return 1;
+    }
+    char path[64], corrupt_path[64];
+    snprintf(path, sizeof(path), "%s/model.bin", dir);
+    snprintf(corrupt_path, sizeof(corrupt_path), "%s/corrupt.bin", dir);
+    char text[2000];
+    size_t size = selftest_text(text, sizeof(text) - 40);
+    int failures = 0;
+
+    for (int pattern = SPLIT_NONE; pattern <= SPLIT_GPT4; ++pattern) {
+        BasicTokenizer *tokenizer = create_tokenizer();
+        set_split_pattern(tokenizer, (SplitPattern)pattern);
+        failures += train_bytes(tokenizer, text, size, 330, 0) != 0;
+        failures += add_special_token(tokenizer, "<|endoftext|>", 100257) != 0;
+        failures += add_special_token(tokenizer, "<|fim|>", 100258) != 0;
+        failures += save_tokenizer(tokenizer, path) != 0;
+        char special_text[2100];
+        memcpy(special_text, text, size);
+        memcpy(special_text + size, "<|fim|>a<|endoftext|>", 21);
+        BasicTokenizer *loaded = load_tokenizer(path);
+        failures += !loaded || !selftest_same_tokenizer(tokenizer, loaded, special_text, size + 21);
+        if (loaded) {
+            failures += train_bytes(loaded, text, size, 400, 0) != -1;
+            clean_tokenizer(loaded);
+        }
+        clean_tokenizer(tokenizer);
+    }
+
+    // The file of the last round, read back to be corrupted one field at a time.
+    FILE *file = fopen(path, "rb");
+    unsigned char *bytes = (unsigned char*)malloc(1 << 16);
+    size_t file_size = file ? fread(bytes, 1, 1 << 16, file) : 0;
+    if (file) {
+        fclose(file);
+    }
+    failures += file_size < sizeof(ModelHeader) || file_size == 1 << 16;
+    ModelHeader header;
+    memcpy(&header, bytes, sizeof(ModelHeader));
+    size_t merges_at = align8(sizeof(ModelHeader));
+    size_t vocab_at = merges_at + align8(header.num_merges * sizeof(Merge)) +
+                      align8((header.vocab_size + 1) * sizeof(size_t)) +
+                      align8(header.rank_capacity * sizeof(uint64_t)) + align8(header.rank_capacity * sizeof(size_t));
+    size_t special_ids_at = vocab_at + align8(header.vocab_bytes);
+
+    unsigned char *corrupt = (unsigned char*)malloc(file_size + 1);
+    for (int c = 0; c < 14; ++c) {
+        memcpy(corrupt, bytes, file_size);
+        ModelHeader *h = (ModelHeader*)corrupt;
+        size_t corrupt_size = file_size;
+        switch (c) {
+        case 0: h->magic[0] = 'X'; break;
+        case 1: h->version = MODEL_VERSION - 1; break;
+        case 2: h->byte_order = 0x04030201u; break;
+        case 3: h->vocab_size = (uint64_t)1 << 40; break;
+        case 4: h->num_merges = h->vocab_size; break;
+        case 5: h->rank_capacity += 1; break;
+        case 6: h->rank_size = h->rank_capacity; break;
+        case 7: h->split_pattern = SPLIT_GPT4 + 1; break;
+        case 8: h->vocab_bytes += 1; break;
+        case 9: h->num_specials = (uint64_t)1 << 60; break;
+        case 10: ((Merge*)(corrupt + merges_at))[0].pair.first = (int)h->vocab_size; break;
+        case 11: ((int32_t*)(corrupt + special_ids_at))[0] = 300; break;
+        case 12: corrupt_size = sizeof(ModelHeader) - 1; break;
+        case 13: corrupt_size = special_ids_at; break;
+        }
+        failures += selftest_write_file(corrupt_path, corrupt, corrupt_size) != 0;
+        BasicTokenizer *loaded = load_tokenizer(corrupt_path);
+        failures += loaded != NULL;
+        if (loaded) {
+            clean_tokenizer(loaded);
+        }
+    }
+    failures += load_tokenizer("/nonexistent/minbpe-selftest.bin") != NULL;
+
+    unlink(path);
+    unlink(corrupt_path);
+    rmdir(dir);
+    free(bytes);
+    free(corrupt);
+    return failures;
+}
+
+// save_minbpe_model() and load_minbpe_model() round-trip a tokenizer, files written by minbpe load
+// with minbpe's ids, and malformed files are refused.
+static int selftest_minbpe_model() {
+    char dir[] = "/tmp/minbpe-selftest-XXXXXX";
+    if (!mkdtemp(dir)) {
+        return 1;
+    }
+    char prefix[64], model[80], vocab[80];
+    snprintf(prefix, sizeof(prefix), "%s/tok", dir);
+    snprintf(model, sizeof(model), "%s.model", prefix);
+    snprintf(vocab, sizeof(vocab), "%s.vocab", prefix);
+    char text[2100];
+    size_t size = selftest_text(text, 2000);
+    memcpy(text + size, "<|endoftext|>", 13);
+    int failures = 0;
+
+    for (int pattern = SPLIT_NONE; pattern <= SPLIT_GPT4; ++pattern) {
+        BasicTokenizer *tokenizer = create_tokenizer();
+        set_split_pattern(tokenizer, (SplitPattern)pattern);
+        failures += train_bytes(tokenizer, text, size, 330, 0) != 0;
+        failures += add_special_token(tokenizer, "<|endoftext|>", 100257) != 0;
+        failures += save_minbpe_model(tokenizer, prefix) != 0 || access(vocab, R_OK) != 0;
+        BasicTokenizer *loaded = load_minbpe_model(model);
+        failures += !loaded || !selftest_same_tokenizer(tokenizer, loaded, text, size + 13);
+        if (loaded) {
+            clean_tokenizer(loaded);
+        }
+        clean_tokenizer(tokenizer);
+    }
+
+    // As minbpe's save() writes it: version, pattern, special tokens, then one merge per line.
+    static const char written_by_minbpe[] = "minbpe v1\n\n1\n<|endoftext|> 300\n97 97\n256 97\n";
+    failures += selftest_write_file(model, written_by_minbpe, sizeof(written_by_minbpe) - 1) != 0;
+    BasicTokenizer *loaded = load_minbpe_model(model);
+    int ids[8];
+    size_t ids_size = 0;
+    failures += !loaded || loaded->split_pattern != SPLIT_NONE ||
+                encode_special(loaded, "aaaa<|endoftext|>aaa", 20, SPECIAL_ALL, NULL, 0, ids, &ids_size) != 0 ||
+                !selftest_same(ids, ids_size, (const int[]){ 256, 256, 300, 257 }, 4);
+    if (loaded) {
+        clean_tokenizer(loaded);
+    }
+    char with_pattern[512];
+    int length = snprintf(with_pattern, sizeof(with_pattern), "minbpe v1\n%s\n0\n97 97\n", GPT4_SPLIT_PATTERN);
+    failures += selftest_write_file(model, with_pattern, (size_t)length) != 0;
+    loaded = load_minbpe_model(model);
+    failures += !loaded || loaded->split_pattern != SPLIT_GPT4 || loaded->num_merges != 1;
+    if (loaded) {
+        clean_tokenizer(loaded);
+    }
+
+    static const char *const malformed[] = {
+        "minbpe v2\n\n0\n97 97\n",                        // unknown version
+        "minbpe v1\n\\s+\n0\n97 97\n",                    // a pattern bpe.c cannot run
+        "minbpe v1\n\n",                                  // no special token count
+        "minbpe v1\n\n1\n",                               // a special token is missing
+        "minbpe v1\n\n0\n256 97\n",                       // merge of a token not merged yet
+        "minbpe v1\n\n0\n97 97 98\n",                     // trailing field
+        "minbpe v1\n\n0\n-1 97\n",                        // negative id
+        "minbpe v1\n\n1\n<|endoftext|> 256\n97 97\n",     // special id taken by a merge
+    };
+    for (size_t m = 0; m < sizeof(malformed) / sizeof(malformed[0]); ++m) {
+        failures += selftest_write_file(model, malformed[m], strlen(malformed[m])) != 0;
+        loaded = load_minbpe_model(model);
+        failures += loaded != NULL;
+        if (loaded) {
+            clean_tokenizer(loaded);
+        }
+    }
+    failures += load_minbpe_model("/nonexistent/minbpe-selftest.model") != NULL;
+
+    unlink(model);
+    unlink(vocab);
+    rmdir(dir);
+    return failures;
+}
+
+// The stream decoder writes every complete character as soon as its last byte arrives, holds back
+// only an unfinished but still valid UTF-8 sequence, and passes invalid bytes through.
+static int selftest_stream_decoder() {
+    enum { CAPACITY = 3000 };
+    char text[CAPACITY], out[CAPACITY + 64];
+    int ids[CAPACITY];
+    int failures = 0;
+    for (int round = 0; round < 10; ++round) {
+        size_t size = selftest_text(text, CAPACITY);
+        BasicTokenizer *tokenizer = create_tokenizer();
+        failures += train_bytes(tokenizer, text, size, 300 + 10 * round, 0) != 0;
+        size_t ids_size;
+        failures += encode_bytes(tokenizer, text, size, ids, &ids_size) != 0;
+
+        StreamDecoder decoder;
+        stream_decoder_init(&decoder, tokenizer);
+        size_t decoded = 0, written = 0;
+        for (size_t i = 0; i < ids_size; ++i) {
+            size_t length;
+            token_bytes(tokenizer, ids[i], &length);
+            decoded += length;
+            written += stream_decoder_push(&decoder, ids[i], out + written);
+            // The text is valid UTF-8, so everything up to the last character boundary is out.
+            size_t boundary = decoded;
+            while (boundary < size && boundary > 0 && ((unsigned char)text[boundary] & 0xc0) == 0x80) {
+                boundary--;
+            }
+            failures += written != boundary;
+        }
+        written += stream_decoder_flush(&decoder, out + written);
+        failures += written != size || memcmp(out, text, size) != 0;
+        clean_tokenizer(tokenizer);
+    }
+
+    // Byte tokens, with the bytes each push and the final flush must write.
+    static const struct {
+        int ids[4];
+        size_t num_ids;
+        size_t written[4];
+        size_t flushed;
+    } cases[] = {
+        { { 0xe4, 0xb8, 0xad }, 3, { 0, 0, 3 }, 0 },        // U+4E2D
+        { { 0xe4, 'a' }, 2, { 0, 2 }, 0 },                  // lead byte cut short
+        { { 0xff, 0x80, 0xc0 }, 3, { 1, 1, 1 }, 0 },        // never valid
+        { { 0xed, 0xa0 }, 2, { 0, 2 }, 0 },                 // surrogate
+        { { 0xf0, 0x9f, 0x99 }, 3, { 0, 0, 0 }, 3 },        // unfinished at the end
+        { { 0xf0, 0x9f, 0x99, 0x82 }, 4, { 0, 0, 0, 4 }, 0 } // U+1F642
+    };
+    BasicTokenizer *tokenizer = create_tokenizer();
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c) {
+        StreamDecoder decoder;
+        stream_decoder_init(&decoder, tokenizer);
+        size_t written = 0;
+        for (size_t i = 0; i < cases[c].num_ids; ++i) {
+            size_t length = stream_decoder_push(&decoder, cases[c].ids[i], out + written);
+            failures += length != cases[c].written[i];
+            written += length;
+        }
+        size_t flushed = stream_decoder_flush(&decoder, out + written);
+        failures += flushed != cases[c].flushed || written + flushed != cases[c].num_ids;
+        for (size_t i = 0; i < cases[c].num_ids && i < written + flushed; ++i) {
+            failures += (unsigned char)out[i] != cases[c].ids[i];
+        }
+        failures += stream_decoder_flush(&decoder, out) != 0;
+    }
+    clean_tokenizer(tokenizer);
+    return failures;
+}
+
+// Appends the ids of plain text, as a tokenizer without special tokens encodes it.
+static void selftest_expect_text(const BasicTokenizer *plain, const char *text, size_t size, int *ids, size_t *ids_size) {
+    size_t count = 0;
+    encode_bytes(plain, text, size, ids + *ids_size, &count);
+    *ids_size += count;
+}
+
+// encode_special() recognises exactly the special tokens its policy allows, encodes the rest of
+// the text as a tokenizer without them would, and with SPECIAL_NONE_RAISE refuses text containing one.
+static int selftest_special_policies() {
+    enum { CAPACITY = 3000 };
+    static const char *const strings[] = { "<|end|>", "<|fim|>" };
+    char *text = (char*)malloc(CAPACITY + 64);
+    int *ids = (int*)malloc((CAPACITY + 64) * sizeof(int));
+    int *expected = (int*)malloc((CAPACITY + 64) * sizeof(int));
+    int failures = 0;
+    for (int round = 0; round < 12; ++round) {
+        BasicTokenizer *plain = create_tokenizer();
+        BasicTokenizer *tokenizer = create_tokenizer();
+        set_split_pattern(plain, (SplitPattern)(round % 3));
+        set_split_pattern(tokenizer, (SplitPattern)(round % 3));
+        size_t size = selftest_text(text, CAPACITY);
+        failures += train_bytes(plain, text, size, 320, 0) != 0 || train_bytes(tokenizer, text, size, 320, 0) != 0;
+        failures += add_special_token(tokenizer, strings[0], 1000) != 0 || add_special_token(tokenizer, strings[1], 1001) != 0;
+
+        // Text with specials between random pieces; none in the first rounds' text.
+        size = 0;
+        size_t starts[8], ends[8];
+        int kinds[8];
+        int num_specials = round < 2 ? 0 : 1 + selftest_rand() % 8;
+        for (int k = 0; k <= num_specials; ++k) {
+            size += selftest_text(text + size, CAPACITY / 9);
+            if (k < num_specials) {
+                kinds[k] = selftest_rand() % 2;
+                starts[k] = size;
+                memcpy(text + size, strings[kinds[k]], 7);
+                size += 7;
+                ends[k] = size;
+            }
+        }
+
+        size_t ids_size, expected_size = 0;
+        selftest_expect_text(plain, text, size, expected, &expected_size);
+        failures += encode_special(tokenizer, text, size, SPECIAL_NONE, NULL, 0, ids, &ids_size) != 0 ||
+                    !selftest_same(expected, expected_size, ids, ids_size);
+        const int unknown = 5;
+        failures += encode_special(tokenizer, text, size, SPECIAL_CUSTOM, &unknown, 1, ids, &ids_size) != 0 ||
+                    !selftest_same(expected, expected_size, ids, ids_size);
+        int raised = encode_special(tokenizer, text, size, SPECIAL_NONE_RAISE, NULL, 0, ids, &ids_size);
+        failures += num_specials > 0 ? raised != -1 || ids_size != 0
+                                     : raised != 0 || !selftest_same(expected, expected_size, ids, ids_size);
+        raised = encode_bytes(tokenizer, text, size, ids, &ids_size);
+        failures += num_specials > 0 ? raised != -1 : raised != 0 || !selftest_same(expected, expected_size, ids, ids_size);
+
+        // SPECIAL_ALL, then each special alone through SPECIAL_CUSTOM.
+        for (int allow = -1; allow < 2; ++allow) {
+            expected_size = 0;
+            size_t pos = 0;
+            for (int k = 0; k < num_specials; ++k) {
+                if (allow == -1 || allow == kinds[k]) {
+                    selftest_expect_text(plain, text + pos, starts[k] - pos, expected, &expected_size);
+                    expected[expected_size++] = 1000 + kinds[k];
+                    pos = ends[k];
+                }
+            }
+            selftest_expect_text(plain, text + pos, size - pos, expected, &expected_size);
+            const int allowed = 1000 + allow;
+            int status = allow == -1 ? encode_special(tokenizer, text, size, SPECIAL_ALL, NULL, 0, ids, &ids_size)
+                                     : encode_special(tokenizer, text, size, SPECIAL_CUSTOM, &allowed, 1, ids, &ids_size);
+            failures += status != 0 || !selftest_same(expected, expected_size, ids, ids_size);
+        }
+        clean_tokenizer(plain);
+        clean_tokenizer(tokenizer);
+    }
+
+    // Overlapping specials: the one starting first wins, then the one registered first.
+    BasicTokenizer *plain = create_tokenizer();
+    BasicTokenizer *tokenizer = create_tokenizer();
+    failures += add_special_token(tokenizer, "<|a|>", 1000) != 0 || add_special_token(tokenizer, "<|a|>b", 1001) != 0 ||
+                add_special_token(tokenizer, "|a|>bc", 1002) != 0;
+    static const struct {
+        int allowed[2];
+        size_t num_allowed;
+        const char *before;
+        int id;
+        const char *after;
+    } cases[] = {
+        { { 0 }, 0, "x", 1000, "bcy" },
+        { { 1001 }, 1, "x", 1001, "cy" },
+        { { 1002 }, 1, "x<", 1002, "y" },
+        { { 1002, 1001 }, 2, "x", 1001, "cy" },
+    };
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c) {
+        size_t ids_size, expected_size = 0;
+        selftest_expect_text(plain, cases[c].before, strlen(cases[c].before), expected, &expected_size);
+        expected[expected_size++] = cases[c].id;
+        selftest_expect_text(plain, cases[c].after, strlen(cases[c].after), expected, &expected_size);
+        int status = cases[c].num_allowed == 0
+                   ? encode_special(tokenizer, "x<|a|>bcy", 9, SPECIAL_ALL, NULL, 0, ids, &ids_size)
+                   : encode_special(tokenizer, "x<|a|>bcy", 9, SPECIAL_CUSTOM, cases[c].allowed, cases[c].num_allowed,
+                                    ids, &ids_size);
+        failures += status != 0 || !selftest_same(expected, expected_size, ids, ids_size);
+    }
+    clean_tokenizer(plain);
+    clean_tokenizer(tokenizer);
+    free(text);
+    free(ids);
+    free(expected);
+    return failures;
+}
+
+// Rebuilding the merge index reuses its slots instead of taking new arena space every time.
+static int selftest_merge_index() {
+    char text[3000];
+    size_t size = selftest_text(text, sizeof(text));
+    BasicTokenizer *tokenizer = create_tokenizer();
+    int failures = train_bytes(tokenizer, text, size, 400, 0) != 0;
+    size_t used = 0;
+    for (int round = 0; round < 50; ++round) {
+        failures += build_merge_index(tokenizer) != 0;
+        size_t now = 0;
+        for (const ArenaBlock *block = tokenizer->arena.head; block; block = block->next) {
+            now += block->used;
+        }
+        failures += round > 0 && now != used;
+        used = now;
+    }
+    for (size_t i = 0; i < tokenizer->num_merges; ++i) {
+        failures += merge_rank(tokenizer, tokenizer->merges[i].pair) != i;
+    }
+    failures += merge_rank(tokenizer, (IntPair){ 1000, 1000 }) != tokenizer->num_merges;
+    clean_tokenizer(tokenizer);
+    return failures;
+}
+
+// Chunk lengths that Python's regex module gives for both split patterns.
+static int selftest_split() {
+    static const struct {
+        SplitPattern pattern;
+        const char *text;
+        size_t lengths[6];
+    } cases[] = {
+        { SPLIT_GPT2, "Hello world's 123!!", { 5, 6, 2, 4, 2 } },
+        { SPLIT_GPT2, "'S  \n x", { 1, 1, 3, 2 } },
+        { SPLIT_GPT4, "'S  \n x", { 2, 3, 2 } },
+        { SPLIT_GPT4, "12345 a'LL", { 3, 2, 2, 3 } },
+        { SPLIT_GPT4, "'\xc5\xbfx", { 3, 1 } },
+        { SPLIT_GPT2, "'\xc5\xbfx", { 1, 3 } },
+        { SPLIT_GPT4, "caf\xc3\xa9\xe2\x84\xa2 \xd9\xa3", { 5, 3, 1, 2 } }
+    };
+    int failures = 0;
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c) {
+        const unsigned char *bytes = (const unsigned char*)cases[c].text;
+        size_t size = strlen(cases[c].text), pos = 0, i = 0;
+        for (; pos < size && i < 6; ++i) {
+            size_t length = split_chunk(cases[c].pattern, bytes + pos, size - pos);
+            failures += length != cases[c].lengths[i];
+            pos += length;
+        }
+        failures += pos != size || (i < 6 && cases[c].lengths[i] != 0);
+    }
+    return failures;
+}
+
+// Prints how many checks of one kind failed and returns that number.
+static int selftest_report(const char *name, int failures) {
+    printf("%s: %d failures\n", name, failures);
+    return failures;
+}
+
+int main() {
+    ThreadPool *pool = create_thread_pool(4);
+    int failures = 0;
+    failures += selftest_report("merge_parallel vs merge", selftest_merge_parallel(pool));
+    failures += selftest_report("merge_many vs merge", selftest_merge_many());
+    failures += selftest_report("training out of memory", selftest_train_out_of_memory(pool));
+    failures += selftest_report("untrainable tokenizers", selftest_train_rejects(pool));
+    failures += selftest_report("trainers and encoders vs quadratic reference", selftest_train_and_encode(pool));
+    failures += selftest_report("split patterns vs Python regex", selftest_split());
+    failures += selftest_report("allocator and out of memory", selftest_allocator(pool));
+    failures += selftest_report("merge index rebuilds", selftest_merge_index());
+    failures += selftest_report("encode_batch vs encode_bytes", selftest_encode_batch(pool));
+    failures += selftest_report("train_files vs quadratic reference", selftest_train_files());
+    failures += selftest_report("decode truncation", selftest_decode());
+    failures += selftest_report("save_tokenizer and load_tokenizer", selftest_save_load());
+    failures += selftest_report("minbpe .model files", selftest_minbpe_model());
+    failures += selftest_report("stream decoder", selftest_stream_decoder());
+    failures += selftest_report("special token policies", selftest_special_policies());
+    destroy_thread_pool(pool);
+    return failures ? 1 : 0;
+}
+#else
+int main(int argc, char **argv) {
+    BasicTokenizer *tokenizer = create_tokenizer();
+    
+    const char *text = "hello world the sky is blue";
+    size_t vocab_size = 300;
+
+    printf("Input Text:%s\n",text);
+    if (argc > 1) {
+        // Train on the files and directories given on the command line instead
+        if (train_files(tokenizer, (const char *const*)argv + 1, argc - 1, vocab_size, 1) != 0) {
+            fprintf(stderr, "Failed to read the training corpus\n");
+            clean_tokenizer(tokenizer);
+            return 1;
+        }
+    } else {
+        train(tokenizer, text, vocab_size, 1);
+    }
+
+    // Encode the text
+    size_t text_size = strlen(text);
+    int *ids = (int*)malloc(text_size * sizeof(int));
+    size_t ids_size = 0;
+    encode(tokenizer, text, ids, &ids_size);
     
     // Decode the ids
-    char decoded_text[MAX_TEXT_SIZE];
-    decode(tokenizer, ids, ids_size, decoded_text);
+    size_t decoded_size = decode(tokenizer, ids, ids_size, NULL, 0) + 1;
+    char *decoded_text = (char*)malloc(decoded_size);
+    decode(tokenizer, ids, ids_size, decoded_text, decoded_size);
     
     printf("Encoded IDs:\n");
     for (size_t i = 0; i < ids_size; ++i) {
@@ -277,7 +5742,10 @@ int main() {
     }
     printf("\nDecoded text: %s\n", decoded_text);
     
+    free(decoded_text);
+    free(ids);
     clean_tokenizer(tokenizer);
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
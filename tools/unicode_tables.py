@@ -0,0 +1,43 @@
+"""Prints the letter, number and whitespace tables of minbpe.c.
+
+Each code point is tested against \\p{L}, \\p{N} and \\s with the Python
+`regex` module that minbpe's split patterns use, so the tables follow the
+Unicode version of the installed module:
+
+    pip install regex
+    python tools/unicode_tables.py > tables.c
+"""
+
+import regex
+
+
+def ranges(pattern):
+    compiled = regex.compile(pattern)
+    found, start = [], None
+    for cp in range(0x110000):
+        match = not 0xD800 <= cp <= 0xDFFF and compiled.match(chr(cp)) is not None
+        if match and start is None:
+            start = cp
+        elif not match and start is not None:
+            found.append((start, cp - 1))
+            start = None
+    if start is not None:
+        found.append((start, 0x10FFFF))
+    return found
+
+
+def table(name, found):
+    lines, line = [], "   "
+    for first, last in found:
+        item = " { 0x%x, 0x%x }," % (first, last)
+        if len(line) + len(item) > 116:
+            lines.append(line)
+            line = "   "
+        line += item
+    lines.append(line.rstrip(","))
+    return "static const uint32_t %s[][2] = {\n%s\n};\n" % (name, "\n".join(lines))
+
+
+print(table("letter_ranges", ranges(r"\p{L}")))
+print(table("number_ranges", ranges(r"\p{N}")))
+print(table("space_ranges", ranges(r"\s")), end="")